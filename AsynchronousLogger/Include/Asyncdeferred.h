@@ -0,0 +1,168 @@
+#ifndef Async_DEFERRED_H_
+#define Async_DEFERRED_H_
+/** ==========================================================================
+* Filename:Asyncdeferred.h  Deferred ("binary") argument capture for LOGF_DEFER
+*
+* The caller thread only copies the raw argument values into a flat byte
+* buffer. The printf-like formatting is done later by the background worker,
+* in the spirit of NanoLog and fmtlog.
+*
+* Captured as:
+*   integers, bool, enums         -> 64 bit signed / unsigned
+*   float, double, long double    -> double
+*   const TCHAR*, const char*,
+*   tstring                       -> copied, at most DEFERRED_MAX_STRING_LENGTH characters
+*   AsyncLogger::literal(str)     -> pointer only, the string MUST have static storage
+*   any other pointer             -> pointer value (%p)
+*
+* ********************************************* */
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+#include <type_traits>
+
+#define DEFERRED_MAX_STRING_LENGTH 256
+#define DEFERRED_INLINE_SIZE 256 // argument bytes kept inside DeferredArgs before it spills to the heap
+
+namespace AsyncLogger {
+
+/// Marks a string with static storage duration (literal, global table ...) so that
+/// LOGF_DEFER captures only its address instead of copying the characters
+struct literal_arg {
+   explicit literal_arg(const TCHAR* str) : str_(str) {}
+   const TCHAR* str_;
+};
+
+inline literal_arg literal(const TCHAR* str) { return literal_arg(str); }
+
+namespace internal {
+
+enum DeferredArgType {
+   kDeferredSigned = 1,
+   kDeferredUnsigned,
+   kDeferredDouble,
+   kDeferredPointer,
+   kDeferredLiteral,
+   kDeferredString
+};
+
+/** Flat, copyable buffer of tagged raw arguments: [type][value] or [type][length][characters]
+* The usual handful of arguments fits the inline storage, so capturing them does not allocate */
+class DeferredArgs {
+ public:
+   DeferredArgs() : size_(0) {}
+
+   bool empty() const { return 0 == size_; }
+   size_t size() const { return size_; }
+   const unsigned char* data() const { return size_ ? bytes() : nullptr; }
+   void clear() { size_ = 0; }
+   void assign(const unsigned char* data, size_t size) { clear(); append(data, size); }
+
+   template<typename T>
+   void add(const T& value) {
+      addValue(value, typename std::integral_constant<int,
+               std::is_floating_point<T>::value ? 1 :
+               (std::is_integral<T>::value || std::is_enum<T>::value) ? 2 :
+               std::is_pointer<T>::value ? 3 : 0>());
+   }
+
+   void add(const TCHAR* str) { addString(str, str ? std::char_traits<TCHAR>::length(str) : 0); }
+   void add(TCHAR* str) { add(static_cast<const TCHAR*>(str)); }
+   void add(const tstring& str) { addString(str.c_str(), str.size()); }
+   void add(const literal_arg& str) { addRaw(kDeferredLiteral, &str.str_, sizeof(str.str_)); }
+
+#ifdef _UNICODE
+   void add(const char* str) {
+      TCHAR widened[DEFERRED_MAX_STRING_LENGTH];
+      const size_t length = str ? std::min<size_t>(std::strlen(str), DEFERRED_MAX_STRING_LENGTH) : 0;
+      std::copy(str, str + length, widened);
+      addString(widened, length);
+   }
+   void add(char* str) { add(static_cast<const char*>(str)); }
+#endif
+
+   template<typename T, typename... Rest>
+   void addAll(const T& first, const Rest&... rest) {
+      add(first);
+      addAll(rest...);
+   }
+   void addAll() {}
+
+ private:
+   template<typename T>
+   void addValue(const T& value, std::integral_constant<int, 1>) {
+      const double converted = static_cast<double>(value);
+      addRaw(kDeferredDouble, &converted, sizeof(converted));
+   }
+
+   template<typename T>
+   void addValue(const T& value, std::integral_constant<int, 2>) {
+      if (std::is_signed<T>::value) {
+         const long long converted = static_cast<long long>(value);
+         addRaw(kDeferredSigned, &converted, sizeof(converted));
+      } else {
+         const unsigned long long converted = static_cast<unsigned long long>(value);
+         addRaw(kDeferredUnsigned, &converted, sizeof(converted));
+      }
+   }
+
+   template<typename T>
+   void addValue(const T& value, std::integral_constant<int, 3>) {
+      const void* converted = static_cast<const void*>(value);
+      addRaw(kDeferredPointer, &converted, sizeof(converted));
+   }
+
+   void addString(const TCHAR* str, size_t length) {
+      if (length > DEFERRED_MAX_STRING_LENGTH) {
+         length = DEFERRED_MAX_STRING_LENGTH;
+      }
+      const unsigned int stored_length = static_cast<unsigned int>(length);
+      addRaw(kDeferredString, &stored_length, sizeof(stored_length));
+      append(str, length * sizeof(TCHAR));
+   }
+
+   void addRaw(DeferredArgType type, const void* value, size_t length) {
+      const unsigned char tag = static_cast<unsigned char>(type);
+      append(&tag, 1);
+      append(value, length);
+   }
+
+   void append(const void* value, size_t length) {
+      const unsigned char* begin = static_cast<const unsigned char*>(value);
+      if (spilled_.empty() && size_ + length <= DEFERRED_INLINE_SIZE) {
+         std::memcpy(inline_ + size_, begin, length);
+      } else {
+         if (spilled_.empty()) {
+            spilled_.assign(inline_, inline_ + size_);
+         } else {
+            spilled_.resize(size_);
+         }
+         spilled_.insert(spilled_.end(), begin, begin + length);
+      }
+      size_ += length;
+   }
+
+   const unsigned char* bytes() const { return spilled_.empty() ? inline_ : &spilled_[0]; }
+
+   unsigned char inline_[DEFERRED_INLINE_SIZE];
+   size_t size_;
+   std::vector<unsigned char> spilled_; // once the arguments outgrow inline_, kept for reuse
+};
+
+/// Renders printf_like_message with the captured arguments. Runs on the background worker.
+/// Unsupported or mismatching conversions are rendered as a placeholder instead of failing
+tstring formatDeferred(const TCHAR* printf_like_message, const unsigned char* args, size_t args_size);
+
+/// same as above, appended to out without any allocation of its own
+void appendFormatDeferred(const TCHAR* printf_like_message, const unsigned char* args, size_t args_size, tstring& out);
+
+inline tstring formatDeferred(const TCHAR* printf_like_message, const DeferredArgs& args) {
+   return formatDeferred(printf_like_message, args.data(), args.size());
+}
+
+} // end namespace internal
+} // end namespace AsyncLogger
+
+#endif // Async_DEFERRED_H_
@@ -22,6 +22,14 @@
 #include <chrono>
 #include <functional>
 #include <ctime>
+#include <atomic>
+
+#include <memory>
+
+#include "Asynctime.h"
+#include "Asyncdeferred.h"
+#include "Asyncrecord.h"
+#include "Asyncmessagestream.h"
 
 class AsyncLogWorker;
 
@@ -41,15 +49,13 @@ enum SEVERITY_TYPE
 };
 
 static const tstring k_fatal_log_expression = _T(""); // using LogContractMessage but no boolean expression
-static    bool	is_logging_started = false;
+extern std::atomic<bool> is_logging_started; // set by the AsyncLogWorker once its first log file is open
 
 static tstring log_level_strings [] = {_T("UNKNOWN"), _T("FATAL"), _T("SILENT") , _T("CRITICAL"), _T("WARNING"), _T("INFO"), _T("NORMAL"), _T("DEBUG"), _T("ALL")};
 
 extern tstring _product_name;
 extern tstring _product_version;
 
-extern unsigned int log_level;
-
 // GCC Predefined macros: http://gcc.gnu.org/onlinedocs/cpp/Standard-Predefined-Macros.html
 //     and http://gcc.gnu.org/onlinedocs/gcc/Function-Names.html
 //
@@ -59,6 +65,20 @@ extern unsigned int log_level;
 //         macro as Async_LOG_MYLEVEL, since "#define Async_LOG_MYLEVEL" doesn't exist
 
 
+// Least severe level compiled in. Statements of a less severe level (a higher number) fold away
+// at compile time, their arguments are never evaluated. Define it before including this header,
+// e.g. /D ASYNCLOG_MIN_LEVEL=INFO to drop every LOG(DBUG) from a release build
+#ifndef ASYNCLOG_MIN_LEVEL
+#define ASYNCLOG_MIN_LEVEL LOG_ALL
+#endif
+
+// Module of the LOG statements of a translation unit, for AsyncLogger::setModuleLogLevels.
+// Define it before including this header, e.g. #define ASYNCLOG_MODULE _T("net")
+#ifndef ASYNCLOG_MODULE
+#define ASYNCLOG_MODULE nullptr
+#endif
+
+
 // BELOW -- LOG stream syntax
 
 #define LOGDEBUG LOG(DBUG)
@@ -67,20 +87,49 @@ extern unsigned int log_level;
 #define LOGWARNING LOG(WARNING)
 #define LOGFATAL LOG(FATAL)
 
-#define Async_LOG_DBUG  AsyncLogger::internal::LogMessage($File,__LINE__,$Function,DBUG)
-#define Async_LOG_INFO  AsyncLogger::internal::LogMessage($File,__LINE__,$Function,INFO)
-#define Async_LOG_WARNING  AsyncLogger::internal::LogMessage($File,__LINE__,$Function,WARNING)
-#define Async_LOG_CRITICAL  AsyncLogger::internal::LogMessage($File,__LINE__,$Function,CRITICAL)
-#define Async_LOG_FATAL  AsyncLogger::internal::LogContractMessage($File,__LINE__,$Function,k_fatal_log_expression)
+// Every macro expansion owns one constant-initialized LogCallSite (file, line, level, module and the
+// CallSiteScope of the module). It is registered on first use, which stores the function name and
+// renders the message prefix once.
+// $Function is passed in since inside the lambda it would name the lambda itself
+#define Async_LOG_CALL_SITE(level)                                                              \
+	([](const TCHAR* function) -> const AsyncLogger::internal::LogCallSite& {                    \
+		static AsyncLogger::internal::LogCallSite call_site($File, __LINE__, level, ASYNCLOG_MODULE, &::async_log_call_site_scope); \
+		return call_site.isRegistered() ? call_site : AsyncLogger::internal::registerCallSite(call_site, function); \
+	}($Function))
+
+// The guard of every LOG/LOGF statement: a constant for the compile time level, then the state
+// cached in the call site (see callSiteEnabled). Yields the registered call site, or nullptr if the
+// statement does not log. It runs before the LogMessage or any argument
+#define Async_LOG_ENABLED_CALL_SITE(level)                                                      \
+	((level) <= ASYNCLOG_MIN_LEVEL ?                                                             \
+	[](const TCHAR* function) -> const AsyncLogger::internal::LogCallSite* {                     \
+		static AsyncLogger::internal::LogCallSite call_site($File, __LINE__, level, ASYNCLOG_MODULE, &::async_log_call_site_scope); \
+		if (!AsyncLogger::internal::callSiteEnabled(call_site)) return nullptr;                    \
+		return call_site.isRegistered() ? &call_site : &AsyncLogger::internal::registerCallSite(call_site, function); \
+	}($Function) : nullptr)
+
+// for form: the statement below runs once with async_log_call_site when the level is enabled and
+// condition holds (evaluated after the level). It stays a single statement, a following 'else'
+// cannot bind to it
+#define Async_LOG_STATEMENT(level, condition)                                                   \
+	for (const AsyncLogger::internal::LogCallSite* async_log_call_site = Async_LOG_ENABLED_CALL_SITE(level); \
+	     nullptr != async_log_call_site && (condition); async_log_call_site = nullptr)
+
+#define Async_LOG_DBUG  AsyncLogger::internal::LogMessage(*async_log_call_site)
+#define Async_LOG_INFO  AsyncLogger::internal::LogMessage(*async_log_call_site)
+#define Async_LOG_WARNING  AsyncLogger::internal::LogMessage(*async_log_call_site)
+#define Async_LOG_CRITICAL  AsyncLogger::internal::LogMessage(*async_log_call_site)
+#define Async_LOG_FATAL  AsyncLogger::internal::LogContractMessage(*async_log_call_site,k_fatal_log_expression)
 
 
 #ifdef STATIC_LOG_LEVEL
 #define LOG(level)\
-	if(level <= log_level)          \
+	Async_LOG_STATEMENT(level, true)          \
 		Async_LOG_##level.messageStream()
 #else
 #define LOG(level)\
-	Async_LOG_##level
+	Async_LOG_STATEMENT(level, true)          \
+		Async_LOG_##level
 #endif
 // LOG(level) is the API for the stream log
 
@@ -88,19 +137,56 @@ extern unsigned int log_level;
 
 #ifdef STATIC_LOG_LEVEL
 #define LOG_IF(level, boolean_expression)  \
-	if(level <= log_level)          \
-	  if(true == boolean_expression)          \
+	Async_LOG_STATEMENT(level, true == (boolean_expression))          \
 		 Async_LOG_##level.messageStream()
 #else
 #define LOG_IF(level, boolean_expression)  \
-	  if(true == boolean_expression)          \
+	Async_LOG_STATEMENT(level, true == (boolean_expression))          \
 		 Async_LOG_##level
 #endif
 
+// rate limited stream log: once the level is enabled, rate_check decides with the static state of
+// the statement if this one is logged, and sets async_log_suppressed to the number held back since
+// the previous one. That number starts the message: "[N suppressed] "
+#define Async_LOG_RATE_LIMITED(level, rate_check)                                              \
+	Async_LOG_STATEMENT(level, true)                                                             \
+	for (unsigned long long async_log_suppressed = 0, async_log_once = 1;                       \
+	     0 != async_log_once && (rate_check); async_log_once = 0)
+
+#ifdef STATIC_LOG_LEVEL
+#define Async_LOG_SUPPRESSED(level) Async_LOG_##level.reportSuppressed(async_log_suppressed).messageStream()
+#else
+#define Async_LOG_SUPPRESSED(level) Async_LOG_##level.reportSuppressed(async_log_suppressed)
+#endif
+
+// logs the 1st, n+1th, 2n+1th ... time the statement runs at an enabled level
+#define LOG_EVERY_N(level, n)                                                                  \
+	Async_LOG_RATE_LIMITED(level, [](unsigned long long every, unsigned long long& suppressed) -> bool { \
+		static AsyncLogger::internal::LogEveryNState state;                                        \
+		return state.shouldLog(every, suppressed);                                                 \
+	}((n), async_log_suppressed))                                                                \
+		Async_LOG_SUPPRESSED(level)
+
+// logs the first n times the statement runs at an enabled level, nothing after that
+#define LOG_FIRST_N(level, n)                                                                  \
+	Async_LOG_RATE_LIMITED(level, [](unsigned long long first) -> bool {                        \
+		static AsyncLogger::internal::LogFirstNState state;                                        \
+		return state.shouldLog(first);                                                             \
+	}((n)))                                                                                      \
+		Async_LOG_SUPPRESSED(level)
+
+// logs the statement at most once every ms milliseconds (steady clock)
+#define LOG_EVERY_T(level, ms)                                                                 \
+	Async_LOG_RATE_LIMITED(level, [](long long interval_ms, unsigned long long& suppressed) -> bool { \
+		static AsyncLogger::internal::LogEveryTState state;                                        \
+		return state.shouldLog(interval_ms, suppressed);                                           \
+	}((ms), async_log_suppressed))                                                               \
+		Async_LOG_SUPPRESSED(level)
+
 // Design By Contract, stream API. Throws std::runtime_eror if contract breaks
 #define CHECK(boolean_expression)                                                    \
 if (false == (boolean_expression))                                                     \
-  AsyncLogger::internal::LogContractMessage($File,__LINE__,$Function, _T(#boolean_expression)).messageStream()
+  AsyncLogger::internal::LogContractMessage(Async_LOG_CALL_SITE(FATAL), _T(#boolean_expression)).messageStream()
 
 
 // BELOW -- LOG "printf" syntax
@@ -153,11 +239,11 @@ And here is possible output
 :      floats: 3.14 +3e+000 3.141600E+000
 :      Width trick:    10
 :      A string  \endverbatim */
-#define Async_LOGF_INFO     AsyncLogger::internal::LogMessage($File,__LINE__,$Function,INFO)
-#define Async_LOGF_DBUG    AsyncLogger::internal::LogMessage($File,__LINE__,$Function,DBUG)
-#define Async_LOGF_WARNING  AsyncLogger::internal::LogMessage($File,__LINE__,$Function,WARNING)
-#define Async_LOGF_CRITICAL  AsyncLogger::internal::LogMessage($File,__LINE__,$Function,CRITICAL)
-#define Async_LOGF_FATAL    AsyncLogger::internal::LogContractMessage($File,__LINE__,$Function,k_fatal_log_expression)
+#define Async_LOGF_INFO     AsyncLogger::internal::LogMessage(*async_log_call_site)
+#define Async_LOGF_DBUG    AsyncLogger::internal::LogMessage(*async_log_call_site)
+#define Async_LOGF_WARNING  AsyncLogger::internal::LogMessage(*async_log_call_site)
+#define Async_LOGF_CRITICAL  AsyncLogger::internal::LogMessage(*async_log_call_site)
+#define Async_LOGF_FATAL    AsyncLogger::internal::LogContractMessage(*async_log_call_site,k_fatal_log_expression)
 
 #define LogNormal LogInfo
 
@@ -171,36 +257,30 @@ And here is possible output
 
 #define LogFatal(printf_like_message, ...) LOGF(Fatal, printf_like_message, ##__VA_ARGS__)
 
-#ifdef STATIC_LOG_LEVEL
 // LOGF(level,msg,...) is the API for the "printf" like log
 #define LOGF(level, printf_like_message, ...)                 \
-	if(level <= log_level)          \
+	Async_LOG_STATEMENT(level, true)          \
 		Async_LOGF_##level.messageSave(printf_like_message, ##__VA_ARGS__)
-#else
-// LOGF(level,msg,...) is the API for the "printf" like log
-#define LOGF(level, printf_like_message, ...)                 \
-		Async_LOGF_##level.messageSave(printf_like_message, ##__VA_ARGS__)
-#endif
 
 
-#ifdef STATIC_LOG_LEVEL
-// conditional log printf syntax
-#define LOGF_IF(level,boolean_expression, printf_like_message, ...) \
-	if(level <= log_level)          \
-	  if(true == boolean_expression)                                     \
-		 Async_LOG_##level.messageSave(printf_like_message, ##__VA_ARGS__)
-#else
+// LOGF_DEFER(level,msg,...) is the "printf" like log with deferred formatting: only the raw
+// arguments are copied on the calling thread, the message is formatted by the background worker.
+// printf_like_message MUST be a string literal. See Asyncdeferred.h for how arguments are captured
+#define LOGF_DEFER(level, printf_like_message, ...)                 \
+	Async_LOG_STATEMENT(level, true)          \
+		Async_LOGF_##level.messageDefer(printf_like_message, ##__VA_ARGS__)
+
+
 // conditional log printf syntax
 #define LOGF_IF(level,boolean_expression, printf_like_message, ...) \
-	  if(true == boolean_expression)                                     \
+	Async_LOG_STATEMENT(level, true == (boolean_expression))          \
 		 Async_LOG_##level.messageSave(printf_like_message, ##__VA_ARGS__)
-#endif
 
 
 // Design By Contract, printf-like API syntax with variadic input parameters. Throws std::runtime_eror if contract breaks */
 #define CHECK_F(boolean_expression, printf_like_message, ...)                                     \
    if (false == (boolean_expression))                                                             \
-  AsyncLogger::internal::LogContractMessage($File,__LINE__,$Function,#boolean_expression).messageSave(printf_like_message, ##__VA_ARGS__)
+  AsyncLogger::internal::LogContractMessage(Async_LOG_CALL_SITE(FATAL),_T(#boolean_expression)).messageSave(printf_like_message, ##__VA_ARGS__)
 
 
 /** namespace for LOG() and CHECK() frameworks
@@ -226,27 +306,187 @@ void shutDownLogging();
 */
 bool shutDownLoggingForActiveOnly(AsyncLogWorker* active);
 
+/// Runtime level of the LOG statements without a module override. Thread safe
+void setLogLevel(unsigned int level);
+unsigned int logLevel();
+
+/** Module and file levels that override the runtime level, e.g. _T("net=DBUG, db=WARNING").
+ *  A name matches the ASYNCLOG_MODULE of a LOG statement, or its file name with or without the
+ *  extension (_T("Asynclogworker.cpp=DBUG"), _T("Asynclogworker=DBUG")), case insensitive. The first
+ *  matching entry wins. A level is a name (FATAL ... DBUG or DEBUG, LOG_ALL or ALL) or a number.
+ *  An empty string removes every override. Thread safe
+ *  @return false if the string cannot be parsed, the overrides are then left unchanged */
+bool setModuleLogLevels(const tstring& module_levels);
+
 // defined here but should't not have to be used outside the Asynclog
 namespace internal {
 
 /// returns timepoint as std::time_t
 std::time_t systemtime_now();
 
+/** The call sites of one module: every EXE or DLL linking the library has one, see
+ *  async_log_call_site_scope below. One object with external linkage, so LOG can be used in
+ *  inline functions of headers. Its destructor runs at exit, or when the DLL is unloaded, and
+ *  unregisters them. A DLL must not be unloaded while its records are still queued */
+struct CallSiteScope {
+   constexpr CallSiteScope() {}
+   ~CallSiteScope(); // frees the prefixes too, unless logging is still initialized
+
+ private:
+   CallSiteScope(const CallSiteScope&); // c++11 feature not yet in vs2010 = delete;
+   CallSiteScope& operator=(const CallSiteScope&); // c++11 feature not yet in vs2010 = delete;
+};
+
+/** Static description of one LOG/LOGF/CHECK statement, see Async_LOG_CALL_SITE.
+ *  file, line, level, module and scope are constant-initialized, function and prefix are filled in
+ *  once by registerCallSite, the enabled state by callSiteEnabled */
+struct LogCallSite {
+   constexpr LogCallSite(const TCHAR* file, int line, unsigned int level, const TCHAR* module = nullptr, const CallSiteScope* scope = nullptr)
+      : file_(file), line_(line), level_(level), module_(module), scope_(scope), function_(nullptr), prefix_(nullptr), enabled_state_(0), listed_(false) {}
+
+   bool isRegistered() const { return nullptr != prefix_.load(std::memory_order_acquire); }
+   /// " [LEVEL] [file L: line]\t" (preceded by "Fatal error at: function" for FATAL), valid once registered
+   const tstring& prefix() const { return *prefix_.load(std::memory_order_acquire); }
+
+   const TCHAR* const file_;
+   const int line_;
+   const unsigned int level_;
+   const TCHAR* const module_; // ASYNCLOG_MODULE, nullptr if none
+   const CallSiteScope* const scope_; // nullptr: never unregistered
+   const TCHAR* function_;
+   std::atomic<const tstring*> prefix_;
+   mutable std::atomic<unsigned int> enabled_state_; // CallSiteState for the current levels
+   mutable bool listed_; // in the call site registry, guarded by its mutex
+
+ private:
+   LogCallSite(const LogCallSite&); // c++11 feature not yet in vs2010 = delete;
+   LogCallSite& operator=(const LogCallSite&); // c++11 feature not yet in vs2010 = delete;
+};
+
+/// Registers the call site once (thread safe): stores the function name and renders the prefix
+const LogCallSite& registerCallSite(LogCallSite& call_site, const TCHAR* function);
+
+
+/// LOG_EVERY_N state of one statement. The n - 1 occurrences between two logged ones are suppressed
+struct LogEveryNState {
+   constexpr LogEveryNState() : count_(0) {}
+
+   bool shouldLog(unsigned long long n, unsigned long long& suppressed) {
+      const unsigned long long count = count_.fetch_add(1, std::memory_order_relaxed);
+
+      if (n > 1 && 0 != count % n) {
+         return false;
+      }
+
+      suppressed = (0 == count || n <= 1) ? 0 : n - 1;
+      return true;
+   }
+
+   std::atomic<unsigned long long> count_; // occurrences so far
+
+ private:
+   LogEveryNState(const LogEveryNState&); // c++11 feature not yet in vs2010 = delete;
+   LogEveryNState& operator=(const LogEveryNState&); // c++11 feature not yet in vs2010 = delete;
+};
+
+/// LOG_FIRST_N state of one statement. Past n it is only read, so a hot loop does not keep
+/// writing the shared cache line
+struct LogFirstNState {
+   constexpr LogFirstNState() : count_(0) {}
+
+   bool shouldLog(unsigned long long n) {
+      if (count_.load(std::memory_order_relaxed) >= n) {
+         return false;
+      }
+
+      return count_.fetch_add(1, std::memory_order_relaxed) < n;
+   }
+
+   std::atomic<unsigned long long> count_; // occurrences so far, up to a few past n
+
+ private:
+   LogFirstNState(const LogFirstNState&); // c++11 feature not yet in vs2010 = delete;
+   LogFirstNState& operator=(const LogFirstNState&); // c++11 feature not yet in vs2010 = delete;
+};
+
+/// LOG_EVERY_T state of one statement. The thread that moves next_ns_ on logs, and takes the
+/// count of the occurrences suppressed since the previous one
+struct LogEveryTState {
+   constexpr LogEveryTState() : next_ns_(0), suppressed_(0) {}
+
+   bool shouldLog(long long interval_ms, unsigned long long& suppressed) {
+      const long long now = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+      long long next = next_ns_.load(std::memory_order_relaxed);
+
+      if (now < next || !next_ns_.compare_exchange_strong(next, now + interval_ms * 1000000, std::memory_order_relaxed)) {
+         suppressed_.fetch_add(1, std::memory_order_relaxed);
+         return false;
+      }
+
+      suppressed = suppressed_.exchange(0, std::memory_order_relaxed);
+      return true;
+   }
+
+   std::atomic<long long> next_ns_; // steady clock, 0: the first occurrence is logged
+   std::atomic<unsigned long long> suppressed_;
+
+ private:
+   LogEveryTState(const LogEveryTState&); // c++11 feature not yet in vs2010 = delete;
+   LogEveryTState& operator=(const LogEveryTState&); // c++11 feature not yet in vs2010 = delete;
+};
+
+enum CallSiteState {kCallSiteUnresolved = 0, kCallSiteDisabled, kCallSiteEnabled};
+
+/// Compares the call site with its effective level (module override or runtime level) and caches
+/// the result in it. From then on every level change stores the call site's new state in place
+bool resolveCallSiteEnabled(const LogCallSite& call_site);
+
+/// Hot path of every LOG statement: one relaxed load of the call site's cached state and one
+/// compare. Only the first use of a call site resolves its level
+inline bool callSiteEnabled(const LogCallSite& call_site) {
+   const unsigned int state = call_site.enabled_state_.load(std::memory_order_relaxed);
+
+   if (kCallSiteDisabled == state) {
+      return false;
+   }
+   return kCallSiteEnabled == state || resolveCallSiteEnabled(call_site);
+}
+
 
 struct LogEntry {
-   LogEntry(tstring msg, std::time_t timestamp) : msg_(msg), timestamp_(timestamp) {}
-   LogEntry(const LogEntry& other): msg_(other.msg_), timestamp_(other.timestamp_) {}
-   LogEntry& operator=(const LogEntry& other) {
-      msg_ = other.msg_;
-      timestamp_ = other.timestamp_;
+   LogEntry() : tick_(0), call_site_(nullptr), format_(nullptr) {}
+   LogEntry(tstring msg, AsyncLogger::tick_type tick) : msg_(std::move(msg)), tick_(tick), call_site_(nullptr), format_(nullptr) {}
+   LogEntry(LogEntry&& other)
+      : msg_(std::move(other.msg_)), tick_(other.tick_), call_site_(other.call_site_)
+      , format_(other.format_), args_(std::move(other.args_)) {}
+   LogEntry& operator=(LogEntry&& other) {
+      msg_ = std::move(other.msg_);
+      tick_ = other.tick_;
+      call_site_ = other.call_site_;
+      format_ = other.format_;
+      args_ = std::move(other.args_);
       return *this;
    }
 
 
    tstring msg_;
-   std::time_t timestamp_;
+   AsyncLogger::tick_type tick_;  // when the record was created, the worker writes the time from this
+   const LogCallSite* call_site_; // nullptr for the logger's own entries
+   const TCHAR* format_;   // LOGF_DEFER only: literal format, rendered with args_ and appended to msg_ by the worker
+   std::vector<unsigned char> args_; // DeferredArgs bytes, sized to fit: queued entries stay small
+
+ private:
+   // move-only: a record is moved, never copied, from the LOG call to the file
+   LogEntry(const LogEntry&); // c++11 feature not yet in vs2010 = delete;
+   LogEntry& operator=(const LogEntry&); // c++11 feature not yet in vs2010 = delete;
 };
 
+/// copies a LogRecordRef into a LogEntry, for the transports that queue LogEntry
+LogEntry makeLogEntry(const LogRecordRef& record);
+
+/// appended where a message was cut short
+extern const tstring kTruncatedWarningText;
+
 bool isLoggingInitialized();
 
 /** Trigger for flushing the message queue and exiting the application
@@ -255,17 +495,22 @@ bool isLoggingInitialized();
 struct FatalMessage {
    enum FatalType {kReasonFatal, kReasonOS_FATAL_SIGNAL};
    FatalMessage(LogEntry message, FatalType type, unsigned long signal_id);
+   FatalMessage(FatalMessage&& other);
    ~FatalMessage() {};
-   FatalMessage& operator=(const FatalMessage& fatal_message);
+   FatalMessage& operator=(FatalMessage&& fatal_message);
 
 
    LogEntry message_;
    FatalType type_;
    unsigned long signal_id_;
+
+ private:
+   FatalMessage(const FatalMessage&); // c++11 feature not yet in vs2010 = delete;
+   FatalMessage& operator=(const FatalMessage&); // c++11 feature not yet in vs2010 = delete;
 };
 // Will trigger a FatalMessage sending
 struct FatalTrigger {
-   FatalTrigger(const FatalMessage& message);
+   explicit FatalTrigger(FatalMessage&& message);
    ~FatalTrigger();
    FatalMessage message_;
 };
@@ -274,10 +519,18 @@ struct FatalTrigger {
 // Log message for 'printf-like' or stream logging, it's a temporary message constructions
 class LogMessage {
  public:
-   LogMessage(const tstring& file, const int line, const tstring& function, const unsigned int level);
+   explicit LogMessage(const LogCallSite& call_site);
    virtual ~LogMessage(); // at destruction will flush the message
 
-   tstringstream& messageStream() {return stream_;}
+   tostream& messageStream() {return message_stream_->stream();}
+
+   /// LOG_EVERY_N / LOG_EVERY_T: starts the message with "[count suppressed] " when count is not 0
+   LogMessage& reportSuppressed(unsigned long long count) {
+      if (count && enabled_ && is_logging_started) {
+         messageStream() << _T("[") << count << _T(" suppressed] ");
+      }
+      return *this;
+   }
 
    void WriteLogToStream();
 
@@ -298,23 +551,35 @@ class LogMessage {
 	void messageSave(const char* printf_like_message, ...)
    __attribute__((format(printf, 2, 3) ));
 
+   /// LOGF_DEFER: captures the raw arguments, formatting happens on the background worker
+   template<typename... Args>
+   void messageDefer(const TCHAR* printf_like_message, const Args&... args) {
+      if (enabled_ && is_logging_started && printf_like_message) {
+         deferred_format_ = printf_like_message;
+         deferred_args_.clear();
+         deferred_args_.addAll(args...);
+      }
+   }
+
  protected:
-   const tstring file_;
-   const int line_;
-   const tstring function_;
+   const LogCallSite& call_site_;
    const unsigned int level_;
-   tstringstream stream_;
+   const bool enabled_; // the call site's level is enabled, resolved once at construction
+   MessageStream* message_stream_; // the thread's reusable stream, or own_message_stream_ when nested
+   std::unique_ptr<MessageStream> own_message_stream_;
    tstring log_entry_;
-   std::time_t timestamp_;
+   AsyncLogger::tick_type tick_; // taken in the constructor, i.e. at the LOG call
+   const TCHAR* deferred_format_;
+   DeferredArgs deferred_args_;
 
 public:
     template<class T>
 	LogMessage& operator<<(T const &x) {
 
 
-		if (level_ <= log_level && is_logging_started)
+		if (enabled_ && is_logging_started)
 		{
-			stream_ << x;
+			messageStream() << x;
 		}
 		else
 		{
@@ -326,7 +591,7 @@ public:
 
 	LogMessage& GetLogger() // TODO:: handle this using null streams
 	{
-		if (level_ <= log_level)
+		if (enabled_)
 		{
 			return *this;
 		}
@@ -343,8 +608,7 @@ public:
 // 'Design-by-Contract' temporary messsage construction
 class LogContractMessage : public LogMessage {
  public:
-   LogContractMessage(const tstring& file, const int line,
-                      const tstring& function, const tstring& boolean_expression);
+   LogContractMessage(const LogCallSite& call_site, const tstring& boolean_expression);
    virtual ~LogContractMessage(); // at destruction will flush the message
 
  protected:
@@ -362,4 +626,8 @@ void changeFatalInitHandlerForUnitTesting(std::function<void(FatalMessage) > fat
 } // end namespace internal
 } // end namespace AsyncLogger
 
+// the call sites of this module, see CallSiteScope. Defined in Asynclog.cpp: the static library
+// gives every EXE and DLL linking it its own
+extern AsyncLogger::internal::CallSiteScope async_log_call_site_scope;
+
 #endif // AsyncLOG_H
@@ -0,0 +1,59 @@
+#ifndef Async_LOG_SINK_H_
+#define Async_LOG_SINK_H_
+/** ==========================================================================
+* Filename:Asynclogsink.h  File backends behind the background worker
+*
+* The background worker formats records into TCHAR text and hands whole
+* batches to a LogFileSink. The sink owns the open file, the text encoding
+* and the byte count used for log rotation.
+*
+*   kStreamFileSink : std::wofstream with a UTF-8 codecvt (the original backend)
+*   kPosixFileSink  : raw file descriptor opened with O_APPEND. Batches are
+*                     encoded to UTF-8 once and handed to the operating system
+*                     on flush: writev() on POSIX, the CRT's _write() on Windows
+*
+* All calls are made from the background thread only.
+* ********************************************* */
+
+#include <memory>
+#include <string>
+
+namespace AsyncLogger {
+
+enum LogFileSinkType {
+   kStreamFileSink,
+   kPosixFileSink
+};
+
+enum LogFileFlushResult {
+   kFlushWritten,  // all the text written so far was handed to the operating system
+   kFlushHeldBack, // some text could not be written yet, the next flush() tries again
+   kFlushDropped   // text that could not be written was given up on, with any text held back before
+};
+
+class LogFileSink {
+ public:
+   virtual ~LogFileSink() {}
+
+   /// opens, or creates, the file for appending. \return false if the file cannot be written
+   virtual bool open(const tstring& file_with_full_path) = 0;
+   virtual bool isOpen() const = 0;
+   /// flushes pending text and closes the file, text flush() still holds back is given up on
+   virtual void close() = 0;
+
+   /// takes one batch of formatted records, the text may stay buffered until flush()
+   virtual void write(const TCHAR* text, size_t length) = 0;
+   /// hands the text written so far to the operating system. After a failed write the sink keeps
+   /// the text for the next flush(), up to a bound, then gives it up and says so
+   virtual LogFileFlushResult flush() = 0;
+
+   /// size of the file in bytes, including text not flushed yet
+   virtual unsigned long long size() const = 0;
+};
+
+/// \return a closed sink of the requested type
+std::unique_ptr<LogFileSink> createLogFileSink(LogFileSinkType type);
+
+} // end namespace AsyncLogger
+
+#endif // Async_LOG_SINK_H_
@@ -11,24 +11,153 @@
 #include <string>
 #include <functional>
 #include "Asynclog.h"
+#include "Asynclogsink.h"
+#include "active.h" // ActiveWaitPolicy, ActiveThreadOptions
 
 struct AsyncLogWorkerImpl;
 
+#define LOG_RECORD_QUEUE_CAPACITY 16384
+#define LOG_DROPPED_REPORT_INTERVAL_MS 1000
+#define LOG_THREAD_RING_BYTES (256 * 1024)
+#define LOG_SHARED_RING_BYTES (4 * 1024 * 1024)
+#define LOG_FAST_LANE_BYTES (64 * 1024)
+#define LOG_ROTATE_FILE_KB 1024
+#define LOG_STATS_HISTOGRAM_BUCKETS 40
+
+/// What AsyncLogWorker::save does when the record queue is full, e.g. while the disk stalls
+enum QueueFullPolicy {
+   kBlockProducer,     // the LOG call waits for room (default), nothing is lost
+   kDropNewest,        // the record being logged is dropped
+   kDropOldest,        // the oldest queued record is dropped to make room. Only the record queue can
+                       // drop its oldest record: the records then take kRecordQueue, whatever record_transport says
+   kDropBelowSeverity  // records less severe than drop_level are dropped, the others wait for room
+};
+
+/// When the background thread pushes the buffered log text to the operating system.
+/// Regardless of the policy the file is always flushed before a fatal exit and at shutdown
+struct FlushPolicy {
+   FlushPolicy() : max_pending_chars(64 * 1024), flush_interval_ms(1000), flush_level(CRITICAL) {}
+
+   size_t max_pending_chars;       // flush once this many characters (TCHARs) are written but not flushed
+   unsigned int flush_interval_ms; // flush pending text at least this often
+   unsigned int flush_level;       // flush right after a record of this severity or a more severe one (e.g. CRITICAL, FATAL)
+};
+
+/// How records travel from the logging threads to the background thread
+enum RecordTransport {
+   kSharedByteRing,  // one multi producer byte ring (default). Records are written in place as
+                     // flat bytes and formatted from there: a LOG call does no heap allocation
+   kRecordQueue,     // one lock-free queue of LogEntry shared by all threads
+   kPerThreadRings   // every logging thread gets its own single producer byte ring, registered
+                     // on its first LOG call. The background thread merges the rings by the
+                     // time of the LOG call and reclaims the rings of exited threads once drained
+};
+
+/// Choices fixed for the lifetime of an AsyncLogWorker
+struct AsyncLogWorkerOptions {
+   AsyncLogWorkerOptions()
+      : sink_type(AsyncLogger::kStreamFileSink)
+      , rotate_file_kb(LOG_ROTATE_FILE_KB)
+      , queue_capacity(LOG_RECORD_QUEUE_CAPACITY)
+      , queue_full_policy(kBlockProducer)
+      , drop_level(WARNING)
+      , record_transport(kSharedByteRing)
+      , thread_ring_bytes(LOG_THREAD_RING_BYTES)
+      , shared_ring_bytes(LOG_SHARED_RING_BYTES)
+      , fast_lane_level(CRITICAL)
+      , fast_lane_bytes(LOG_FAST_LANE_BYTES)
+      , format_threads(0) {
+      thread_options.name = "asynclog";
+      format_thread_options.name = "asynclog-fmt";
+   }
+
+   AsyncLogger::LogFileSinkType sink_type; // file backend, see Asynclogsink.h
+   unsigned long long rotate_file_kb;      // a new log file is started once the file grows past this size. 0: never
+   size_t queue_capacity;                  // records, rounded up to a power of two. Also used by the
+                                           // byte ring transports for the logger's own entries
+   QueueFullPolicy queue_full_policy;
+   unsigned int drop_level;                // kDropBelowSeverity: least severe level that is never dropped
+   RecordTransport record_transport;
+   size_t thread_ring_bytes;               // kPerThreadRings: size of each thread's ring
+   size_t shared_ring_bytes;               // kSharedByteRing: size of the ring, rounded up to a power of two
+   AsyncLogger::ActiveWaitPolicy wait_policy; // how the idle background thread waits for records: from
+                                              // kBlockingWait (no CPU while idle) to kBusySpin (lowest latency).
+                                              // A LOG call only wakes it (a syscall) once it sleeps
+   AsyncLogger::ActiveThreadOptions thread_options; // CPU set, nice / SCHED_* policy, name ("asynclog") and NUMA
+                                                    // node of the background thread. With a NUMA node the shared
+                                                    // ring is moved there too
+   unsigned int fast_lane_level;           // records of this severity or a more severe one (CRITICAL by default) skip the
+                                           // queued backlog: written and flushed ahead of it, out of chronological order,
+                                           // tagged with the number of lower priority records still pending (estimated
+                                           // from the bytes waiting on the byte rings). 0: only the FATAL message does
+   size_t fast_lane_bytes;                 // size of the fast lane byte ring, rounded up to a power of two. When full,
+                                           // records take the normal lane
+   unsigned int format_threads;            // 0: the background thread formats and writes (default). Otherwise it collects
+                                           // batches and writes them in order while this many threads format them.
+                                           // They format to TCHAR text, the sink still encodes it on the background thread
+   AsyncLogger::ActiveWaitPolicy format_wait_policy;       // the format threads' own, nothing is taken from wait_policy:
+                                                           // kBusySpin would take one core per format thread
+   AsyncLogger::ActiveThreadOptions format_thread_options; // the format threads' own ("asynclog-fmt"), nothing is taken
+                                                           // from thread_options: e.g. other cpus than the background thread
+
+   // With kDropOldest the records take kRecordQueue, a producer cannot pop what the background thread
+   // reads in place on the byte rings. Records larger than half a ring are truncated to fit, marked "[...truncated...]"
+
+   // Dropped records are counted per level (see AsyncLogWorkerStats) and reported in the
+   // log file as "N messages dropped" at most every LOG_DROPPED_REPORT_INTERVAL_MS. Records
+   // whose text the file sink gives up on after failed writes are counted there too
+};
+
+/// Durations in nanoseconds in power of two buckets: buckets[0] counts the zeros,
+/// buckets[i] the values in [2^(i-1), 2^i), the last bucket everything longer
+struct AsyncLogHistogram {
+   unsigned long long count;
+   unsigned long long total_ns;
+   unsigned long long max_ns;
+   unsigned long long buckets[LOG_STATS_HISTOGRAM_BUCKETS];
+
+   /// upper bound of the bucket reached by fraction (e.g. 0.99) of the values, 0 when empty
+   unsigned long long percentileNs(double fraction) const;
+};
+
+/// Snapshot of the background worker state, see AsyncLogWorker::stats()
+/// The queue depths are sampled by the background thread each time it picks up a batch
+struct AsyncLogWorkerStats {
+   size_t queue_depth;             // records waiting on the record queue
+   size_t queue_depth_high_water;
+   size_t ring_bytes;              // bytes waiting in the byte rings (kSharedByteRing, kPerThreadRings, fast lane)
+   size_t ring_bytes_high_water;
+   size_t pending_chars;           // characters (TCHARs) written to the log file but not flushed yet
+   unsigned long long records_written;  // records dropped by the file sink after they were written are taken off
+   unsigned long long bytes_written; // growth of the log files, as encoded by the sink
+   unsigned long long flushes;
+   unsigned long long rotations;   // log files opened after the first one: size rotations and changeLogFile
+   unsigned long long dropped[LOG_ALL + 1]; // records dropped on a full queue or given up on by the file sink, indexed by SEVERITY_TYPE
+   AsyncLogHistogram queue_latency; // per record, from the LOG call until the background thread picks it up
+   AsyncLogHistogram format_time;   // per batch
+   AsyncLogHistogram write_time;    // per file write, flush included
+};
+
 /**
 * \param log_prefix is the 'name' of the binary, this give the log name 'LOG-'name'-...
 * \param log_directory gives the directory to put the log files */
 class AsyncLogWorker {
  public:
-	 AsyncLogWorker(const tstring& log_prefix, const tstring& log_directory, UINT log_level = CRITICAL, const tstring& product_name = _T("AsyncLogger"), const tstring& version = _T("0.0.1"));
+	 AsyncLogWorker(const tstring& log_prefix, const tstring& log_directory, UINT log_level = CRITICAL, const tstring& product_name = _T("AsyncLogger"), const tstring& version = _T("0.0.1"), const AsyncLogWorkerOptions& options = AsyncLogWorkerOptions());
    virtual ~AsyncLogWorker();
 
    /// pushes in background thread (asynchronously) input messages to log file
-   void save(const AsyncLogger::internal::LogEntry& entry);
+   /// the entry is moved all the way to the file, it is never copied
+   void save(AsyncLogger::internal::LogEntry&& entry);
+
+   /// same as above for a record still held in the LogMessage buffers, serialized
+   /// straight into the transport (see Asyncrecord.h)
+   void save(const AsyncLogger::internal::LogRecordRef& record);
 
    /// Will push a fatal message on the queue, this is the last message to be processed
    /// this way it's ensured that all existing entries were flushed before 'fatal'
    /// Will abort the application!
-   void fatal(AsyncLogger::internal::FatalMessage fatal_message);
+   void fatal(AsyncLogger::internal::FatalMessage&& fatal_message);
 
    /// Attempt to change the current log file to another name/location.
    /// returns filename with full path if successful, else empty string
@@ -36,6 +165,20 @@ class AsyncLogWorker {
 
    void setlogLevel(unsigned int level);
 
+   /// Module and file levels on top of setlogLevel, e.g. _T("net=DBUG, db=WARNING"). See AsyncLogger::setModuleLogLevels
+   bool setModuleLogLevels(const tstring& module_levels);
+
+   /// Maximum number of records the background thread formats into one buffer and
+   /// writes with a single file write. Default LOG_RECORD_BATCH_SIZE (256)
+   void setMaxBatchSize(size_t max_records);
+
+   /// Replaces the flush policy, applied in FIFO order like the other background jobs
+   void setFlushPolicy(const FlushPolicy& policy);
+
+   /// Cheap to call from any thread, values are read without locking. The counters and
+   /// histograms run from the start of the worker, diff two snapshots for a rate
+   AsyncLogWorkerStats stats() const;
+
    /// Does an independent action in FIFO order, compared to the normal LOG statements
    /// Example: auto threadID = [] { std::cout << "thread id: " << std::this_thread::get_id() << std::endl; };
    ///          auto call = logger.genericAsyncCall(threadID); 
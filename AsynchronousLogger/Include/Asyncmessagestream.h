@@ -0,0 +1,123 @@
+#ifndef Async_MESSAGE_STREAM_H_
+#define Async_MESSAGE_STREAM_H_
+/** ==========================================================================
+* Filename:Asyncmessagestream.h  Reusable per-thread storage behind LogMessage::messageStream()
+*
+* Every thread owns one MessageStream: a growable TCHAR buffer with a custom
+* streambuf and one ostream constructed on top of it. LogMessage borrows it
+* for the duration of one statement, so operator<< appends into storage that
+* is reused by the next message instead of building a new stringstream (and
+* its locale) per message.
+*
+* ********************************************* */
+
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#define MESSAGE_STREAM_INITIAL_SIZE 512
+#define MESSAGE_STREAM_MAX_RETAINED_SIZE (64 * 1024) // larger buffers are given back after the message
+
+namespace AsyncLogger {
+namespace internal {
+
+typedef std::basic_ostream<TCHAR, std::char_traits<TCHAR> > tostream;
+
+/// streambuf writing into a growable buffer which is rewound, not freed, between messages
+class MessageStreamBuf : public std::basic_streambuf<TCHAR, std::char_traits<TCHAR> > {
+ public:
+   MessageStreamBuf() : storage_(MESSAGE_STREAM_INITIAL_SIZE) { rewind(); }
+
+   const TCHAR* data() const { return pbase(); }
+   size_t size() const { return static_cast<size_t>(pptr() - pbase()); }
+
+   void rewind() {
+      if (storage_.size() > MESSAGE_STREAM_MAX_RETAINED_SIZE) {
+         std::vector<TCHAR>(MESSAGE_STREAM_INITIAL_SIZE).swap(storage_);
+      }
+      setp(&storage_[0], &storage_[0] + storage_.size());
+   }
+
+ protected:
+   virtual int_type overflow(int_type ch) {
+      if (traits_type::eq_int_type(ch, traits_type::eof())) {
+         return traits_type::not_eof(ch);
+      }
+      grow(1);
+      *pptr() = traits_type::to_char_type(ch);
+      pbump(1);
+      return ch;
+   }
+
+   virtual std::streamsize xsputn(const TCHAR* s, std::streamsize count) {
+      if (epptr() - pptr() < count) {
+         grow(static_cast<size_t>(count));
+      }
+      traits_type::copy(pptr(), s, static_cast<size_t>(count));
+      pbump(static_cast<int>(count));
+      return count;
+   }
+
+ private:
+   void grow(size_t needed) {
+      const size_t used = size();
+      storage_.resize(std::max(storage_.size() * 2, used + needed));
+      setp(&storage_[0], &storage_[0] + storage_.size());
+      pbump(static_cast<int>(used));
+   }
+
+   std::vector<TCHAR> storage_;
+
+   MessageStreamBuf(const MessageStreamBuf&); // c++11 feature not yet in vs2010 = delete;
+   MessageStreamBuf& operator=(const MessageStreamBuf&); // c++11 feature not yet in vs2010 = delete;
+};
+
+
+/// MessageStreamBuf plus the ostream on top of it. The formatting state of the ostream
+/// (precision, flags, fill ...) is restored on reset() so one message cannot leak it into the next
+class MessageStream {
+ public:
+   MessageStream()
+      : in_use_(false)
+      , stream_(&buffer_)
+      , default_flags_(stream_.flags())
+      , default_precision_(stream_.precision())
+      , default_fill_(stream_.fill()) {}
+
+   tostream& stream() { return stream_; }
+   const TCHAR* data() const { return buffer_.data(); }
+   size_t size() const { return buffer_.size(); }
+
+   void reset() {
+      buffer_.rewind();
+      stream_.clear();
+      stream_.flags(default_flags_);
+      stream_.precision(default_precision_);
+      stream_.width(0);
+      stream_.fill(default_fill_);
+   }
+
+   bool in_use_; // taken by a LogMessage on this thread
+
+ private:
+   MessageStreamBuf buffer_;
+   tostream stream_;
+   const std::ios_base::fmtflags default_flags_;
+   const std::streamsize default_precision_;
+   const TCHAR default_fill_;
+
+   MessageStream(const MessageStream&); // c++11 feature not yet in vs2010 = delete;
+   MessageStream& operator=(const MessageStream&); // c++11 feature not yet in vs2010 = delete;
+};
+
+/// \return the reset thread-local MessageStream, or nullptr if an outer LogMessage on this
+///         thread is still using it (e.g. LOG called from inside an operator<<)
+MessageStream* acquireThreadMessageStream();
+void releaseThreadMessageStream(MessageStream* message_stream);
+
+} // end namespace internal
+} // end namespace AsyncLogger
+
+#endif // Async_MESSAGE_STREAM_H_
@@ -0,0 +1,88 @@
+#ifndef Async_RECORD_H_
+#define Async_RECORD_H_
+/** ==========================================================================
+* Filename:Asyncrecord.h  Log records as flat bytes, for the byte ring transports
+*
+* LogMessage describes a finished record with a LogRecordRef: pointers into
+* its own buffers, nothing is copied yet. A byte ring transport serializes it
+* straight into ring memory as
+*
+*   [RecordHeader][text_size TCHARs][args_size DeferredArgs bytes]
+*
+* and the background worker formats it in place from there.
+* ********************************************* */
+
+#include <cstring>
+#include "Asynctime.h"
+
+#define RECORD_ALIGNMENT 8
+
+namespace AsyncLogger {
+namespace internal {
+
+struct LogCallSite;
+
+/// A finished record that is still spread over the LogMessage buffers.
+/// The record text is head + prefix + body
+struct LogRecordRef {
+   AsyncLogger::tick_type tick;
+   const LogCallSite* call_site;
+   const TCHAR* head;      // CHECK contract text, usually empty
+   size_t head_size;
+   const TCHAR* prefix;    // the call site's " [LEVEL] [file L: n]\t"
+   size_t prefix_size;
+   const TCHAR* body;      // the streamed or printf formatted message
+   size_t body_size;
+   const TCHAR* format;    // LOGF_DEFER only: literal format rendered by the worker
+   const unsigned char* args;
+   size_t args_size;
+
+   size_t textSize() const { return head_size + prefix_size + body_size; }
+};
+
+/// Fixed part of a serialized record, followed by the text and the deferred arguments
+struct RecordHeader {
+   AsyncLogger::tick_type tick;
+   const LogCallSite* call_site;
+   const TCHAR* format;
+   unsigned int text_size;  // in TCHARs
+   unsigned int args_size;  // in bytes
+
+   const TCHAR* text() const { return reinterpret_cast<const TCHAR*>(this + 1); }
+   const unsigned char* args() const { return reinterpret_cast<const unsigned char*>(text() + text_size); }
+};
+
+/// bytes needed for the serialized record, padded to RECORD_ALIGNMENT
+inline size_t serializedRecordSize(const LogRecordRef& record) {
+   const size_t size = sizeof(RecordHeader) + record.textSize() * sizeof(TCHAR) + record.args_size;
+   return (size + RECORD_ALIGNMENT - 1) & ~static_cast<size_t>(RECORD_ALIGNMENT - 1);
+}
+
+/// writes the record to at, which must hold serializedRecordSize(record) bytes and be RECORD_ALIGNMENT aligned
+inline void serializeRecord(const LogRecordRef& record, unsigned char* at) {
+   RecordHeader* header = reinterpret_cast<RecordHeader*>(at);
+   header->tick = record.tick;
+   header->call_site = record.call_site;
+   header->format = record.format;
+   header->text_size = static_cast<unsigned int>(record.textSize());
+   header->args_size = static_cast<unsigned int>(record.args_size);
+
+   TCHAR* text = reinterpret_cast<TCHAR*>(header + 1);
+   if (record.head_size) {
+      std::memcpy(text, record.head, record.head_size * sizeof(TCHAR));
+   }
+   if (record.prefix_size) {
+      std::memcpy(text + record.head_size, record.prefix, record.prefix_size * sizeof(TCHAR));
+   }
+   if (record.body_size) {
+      std::memcpy(text + record.head_size + record.prefix_size, record.body, record.body_size * sizeof(TCHAR));
+   }
+   if (record.args_size) {
+      std::memcpy(text + header->text_size, record.args, record.args_size);
+   }
+}
+
+} // end namespace internal
+} // end namespace AsyncLogger
+
+#endif // Async_RECORD_H_
@@ -10,6 +10,19 @@
 #include <string>
 #include <chrono>
 
+#define TIMESTAMP_OFFSET_CHECK_SECONDS 900 // DST and zone offsets change on quarter hours
+
+// Define ASYNCLOG_USE_RDTSC to timestamp records with the CPU time stamp counter instead of
+// steady_clock. Only for x86 CPUs with an invariant TSC (constant rate, synchronized across cores)
+#if defined(ASYNCLOG_USE_RDTSC) && (defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__))
+#define ASYNCLOG_TICKS_ARE_TSC
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#endif
+
 // FYI: 
 // namespace AsyncLogger::internal ONLY in Asynctime.cpp
 //          tstring put_time(const struct tm* tmb, const char* c_time_format)
@@ -34,6 +47,49 @@ namespace AsyncLogger
   * std::put_time. A possible fix if your c++11 library is not updated is to
   * modify this to use std::strftime instead */
   tstring localtime_formatted(const std::time_t& time_snapshot, const tstring& time_format) ;
+
+  /** Monotonic tick taken on the logging thread when a record is created, converted to
+  * wall clock time later by the background worker with @ref ticksToSystemNanoseconds.
+  * steady_clock (CLOCK_MONOTONIC, QueryPerformanceCounter) or the TSC with ASYNCLOG_USE_RDTSC */
+  typedef unsigned long long tick_type;
+
+#ifdef ASYNCLOG_TICKS_ARE_TSC
+  inline tick_type tickNow() { return static_cast<tick_type>(__rdtsc()); }
+#else
+  inline tick_type tickNow() { return static_cast<tick_type>(std::chrono::steady_clock::now().time_since_epoch().count()); }
+#endif
+
+  /** Pairs the tick counter with system_clock and, for the TSC, measures its rate (about 20ms).
+  * Called once by initializeLogging. Ticks converted before that use a quick first calibration */
+  void calibrateTicks();
+
+  /// \return nanoseconds since the epoch (system_clock) for a value of tickNow(). Thread-safe
+  long long ticksToSystemNanoseconds(tick_type tick);
+
+  /** Renders "YYYY/MM/DD hh:mm:ss" (local time) for a stream of increasing timestamps,
+  * as the background worker needs it once per record.
+  * The rendered text is kept for the current second and only the changed digits are
+  * rewritten when the second moves on. The UTC offset is cached as well: local time is
+  * computed arithmetically and AsyncLogger::localtime, which takes the timezone lock,
+  * only runs once per TIMESTAMP_OFFSET_CHECK_SECONDS window, the granularity at which
+  * DST transitions happen. Not thread-safe, one instance per consumer thread */
+  class TimestampCache {
+  public:
+    TimestampCache();
+
+    /// appends the 19 characters for time_snapshot to out
+    void append(const std::time_t& time_snapshot, tstring& out);
+
+  private:
+    void render(const std::time_t& time_snapshot);
+    void refreshUtcOffset(const std::time_t& time_snapshot);
+
+    std::time_t cached_second_;
+    std::time_t offset_valid_from_;
+    std::time_t offset_valid_until_;
+    long utc_offset_;  // seconds to add to UTC to get local time
+    TCHAR text_[20];   // "YYYY/MM/DD hh:mm:ss"
+  };
 }
 
 #endif
@@ -18,29 +18,128 @@
 #include <condition_variable>
 #include <mutex>
 #include <memory>
+#include <vector>
+#include <string>
+#include <atomic>
+#include <climits>
 
 #include "shared_queue.h"
+#include "mpsc_ring_buffer.h"
+
+#define ACTIVE_DEFAULT_RING_CAPACITY 8192
+#define ACTIVE_MAX_BATCH_SIZE 256
+#define ACTIVE_RING_WAIT_MS 10
+#define ACTIVE_IDLE_SPIN_US 50     // how long an idle thread keeps looking for work before it sleeps
+#define ACTIVE_IDLE_SPIN_COUNT 64  // busy checks before it starts yielding while it looks
+#define ACTIVE_THREAD_KEEP INT_MIN // ActiveThreadOptions: leave the setting as inherited
 
 namespace AsyncLogger {
 typedef std::function<void()> Callback;
 
+/// Optional typed queue served by the Active thread next to its Callback queue, so that
+/// high volume items do not have to be wrapped in a Callback each
+class ActiveDrain {
+public:
+  virtual ~ActiveDrain() {}
+  /// Processes queued items on the Active thread, returns how many were handled.
+  /// drain_all is set right after Callbacks were popped, before they run: the items enqueued
+  /// until then must be handled first. Later ones may wait, so that a steady stream of them
+  /// cannot hold the Callbacks up
+  virtual size_t drain(bool drain_all) = 0;
+  /// true if drain() has work, used before the Active thread goes to sleep
+  virtual bool pending() const = 0;
+};
+
+/// How the Active thread waits while it has nothing to do: latency against CPU
+enum ActiveWaitStrategy
+{
+  kSpinThenPark,  // polls for idle_spin_us, then sleeps until woken (default)
+  kBlockingWait,  // sleeps as soon as it is idle: no CPU while idle, every wakeup is a syscall
+  kYieldLoop,     // never sleeps, yields between polls: the core can still be shared
+  kBusySpin       // never sleeps nor yields: lowest latency, takes a whole core, pin it (ActiveThreadOptions::cpus)
+};
+
+struct ActiveWaitPolicy
+{
+  ActiveWaitPolicy() : strategy(kSpinThenPark), idle_spin_us(ACTIVE_IDLE_SPIN_US) {}
+
+  ActiveWaitStrategy strategy;
+  unsigned int idle_spin_us; // kSpinThenPark only
+};
+
+/// Placement of the Active thread, applied by the thread itself before it serves any work.
+/// A setting the platform does not support, or the process may not change, is skipped
+/// with a message on std::cerr; the thread runs anyway
+struct ActiveThreadOptions
+{
+  ActiveThreadOptions()
+    : nice(ACTIVE_THREAD_KEEP)
+    , sched_policy(ACTIVE_THREAD_KEEP)
+    , sched_priority(0)
+    , numa_node(-1) {}
+
+  std::vector<int> cpus; // CPUs the thread may run on, e.g. the housekeeping cores. Empty: any
+  int nice;              // POSIX: nice value of the thread. Windows: mapped to the closest thread priority
+  int sched_policy;      // POSIX only: SCHED_OTHER, SCHED_BATCH, SCHED_IDLE, SCHED_FIFO, SCHED_RR
+  int sched_priority;    // with sched_policy, for SCHED_FIFO / SCHED_RR
+  std::string name;      // thread name shown by top, gdb, perf and the Visual Studio debugger
+  int numa_node;         // memory the thread allocates comes from this node, -1: no preference.
+                         // Buffers allocated before, see bindMemoryToNumaNode()
+};
+
+/// Moves the pages of [memory, memory + size) to numa_node (Linux). Elsewhere it does nothing,
+/// memory stays where it was first touched. \return true if the pages were bound
+bool bindMemoryToNumaNode(const void* memory, size_t size, int numa_node);
+
+/// Transport between the callers of send() and the background thread
+enum ActiveQueueType
+{
+  kLockFreeRingQueue,   // bounded lock-free MPSC ring, drained in batches (default)
+  kSharedQueue          // the mutex protected shared_queue, kept as a fallback
+};
+
 class Active {
 private:
   Active(const Active&); // c++11 feature not yet in vs2010 = delete;
   Active& operator=(const Active&); // c++11 feature not yet in vs2010 = delete;
-  Active();                         // Construction ONLY through factory createActive();
+  Active(ActiveQueueType queue_type, size_t ring_capacity, ActiveDrain* drain, const ActiveWaitPolicy& wait_policy, const ActiveThreadOptions& thread_options); // Construction ONLY through factory createActive();
   void doDone(){done_ = true;}
   void run();
+  void applyThreadOptions();
+  void runSharedQueue();
+  void runRingQueue();
+  bool hasWork() const;
+  void waitForWork();
 
+  const ActiveQueueType queue_type_;
   shared_queue<Callback> mq_;
+  std::unique_ptr<mpsc_ring_buffer<Callback> > ring_;
+  ActiveDrain* drain_;
+  std::mutex wake_mutex_;
+  std::condition_variable wake_cond_;
+  std::atomic<bool> sleeping_; // set by the thread before it parks on wake_cond_, wake() only notifies then
+  const ActiveWaitPolicy wait_policy_;
+  const ActiveThreadOptions thread_options_;
   std::thread thd_;
   bool done_;  // finished flag to be set through msg queue by ~Active
 
 
 public:
   virtual ~Active();
-  void send(Callback msg_);
-  static std::unique_ptr<Active> createActive(); // Factory: safe construction & thread start
+  void send(const Callback& msg_);
+  void send(Callback&& msg_);
+  /// wakes the thread after an item was pushed to the ActiveDrain's own queue.
+  /// Cheap while the thread is awake: the condition variable is only notified when it sleeps
+  void wake();
+  /// \param drain is only served with kLockFreeRingQueue, it must outlive the Active
+  /// \param wait_policy how the idle thread waits for work, kLockFreeRingQueue only. The shared_queue
+  /// always blocks, after polling for idle_spin_us
+  /// \param thread_options CPU set, priority, name and NUMA node of the thread
+  static std::unique_ptr<Active> createActive(ActiveQueueType queue_type = kLockFreeRingQueue,
+                                              size_t ring_capacity = ACTIVE_DEFAULT_RING_CAPACITY,
+                                              ActiveDrain* drain = nullptr,
+                                              const ActiveWaitPolicy& wait_policy = ActiveWaitPolicy(),
+                                              const ActiveThreadOptions& thread_options = ActiveThreadOptions()); // Factory: safe construction & thread start
 };
 } // end namespace AsyncLogger
 
@@ -0,0 +1,248 @@
+/** ==========================================================================
+* Bounded lock-free byte ring for many producers and one consumer.
+*
+* Variable-length blocks live back to back in one contiguous buffer. A
+* producer reserves a block with one CAS on the head, writes it in place and
+* commits it; blocks may be committed out of order. The consumer reads the
+* committed blocks in place, in reservation order, and releases them in one
+* go once it is done with them (e.g. after the file write).
+*
+* Every block starts with a header whose state word tells the consumer if the
+* block is committed. Released memory is zeroed so that a stale state word can
+* never be mistaken for a committed block. A block never wraps: when it does
+* not fit before the end of the buffer, the rest is skipped with a padding block.
+* ********************************************* */
+
+#ifndef MPSC_BYTE_RING_H_
+#define MPSC_BYTE_RING_H_
+
+#include <atomic>
+#include <memory>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "mpsc_ring_buffer.h" // RING_BUFFER_CACHE_LINE_SIZE
+
+class mpsc_byte_ring
+{
+	enum block_state
+	{
+		kBlockReserved = 0, // also: never written / released
+		kBlockCommitted,
+		kBlockPadding
+	};
+
+	struct block_header
+	{
+		uint32_t size_; // whole block including this header
+		std::atomic<uint32_t> state_;
+	};
+
+	static const size_t kBlockAlignment = 8;
+
+	std::unique_ptr<unsigned char[]> buffer_;
+	size_t mask_;
+
+	alignas(RING_BUFFER_CACHE_LINE_SIZE) std::atomic<size_t> head_;
+	alignas(RING_BUFFER_CACHE_LINE_SIZE) std::atomic<size_t> tail_;
+	size_t read_pos_; // consumer only: end of the blocks handed out by peek()/advance(), not yet released
+
+	mpsc_byte_ring(const mpsc_byte_ring&); // c++11 feature not yet in vs2010 = delete;
+	mpsc_byte_ring& operator=(const mpsc_byte_ring&); // c++11 feature not yet in vs2010 = delete;
+
+	static size_t roundUpToPowerOfTwo(size_t value)
+	{
+		size_t result = 64;
+
+		while (result < value)
+		{
+			result <<= 1;
+		}
+
+		return result;
+	}
+
+	block_header* headerAt(size_t position) const
+	{
+		return reinterpret_cast<block_header*>(&buffer_[position & mask_]);
+	}
+
+	// Consumer: clears the state of a block that was read, so that peek() cannot
+	// meet it again once read_pos_ has gone a full lap around an unreleased ring.
+	// \return the block size
+	uint32_t consume(size_t position)
+	{
+		block_header* block = headerAt(position);
+		block->state_.store(kBlockReserved, std::memory_order_relaxed);
+		return block->size_;
+	}
+
+public:
+
+	/// \param capacity in bytes, rounded up to the next power of two
+	explicit mpsc_byte_ring(size_t capacity)
+		: buffer_(new unsigned char[roundUpToPowerOfTwo(capacity)]())
+		, mask_(roundUpToPowerOfTwo(capacity) - 1)
+		, head_(0)
+		, tail_(0)
+		, read_pos_(0)
+	{
+	}
+
+	/// largest payload reserve() can ever succeed with
+	size_t max_block_size() const
+	{
+		return (mask_ + 1) / 2 - sizeof(block_header);
+	}
+
+	/// Producer: \return kBlockAlignment aligned space for size bytes, or nullptr if the ring is full.
+	/// The block must be handed back to commit() once written
+	unsigned char* reserve(size_t size)
+	{
+		if (size > max_block_size())
+		{
+			return nullptr;
+		}
+
+		const size_t capacity = mask_ + 1;
+		const size_t total = (sizeof(block_header) + size + kBlockAlignment - 1) & ~(kBlockAlignment - 1);
+		size_t head = head_.load(std::memory_order_relaxed);
+		size_t to_end = 0;
+
+		for (;;)
+		{
+			to_end = capacity - (head & mask_);
+			const size_t needed = (to_end < total) ? to_end + total : total;
+
+			if (head + needed - tail_.load(std::memory_order_acquire) > capacity)
+			{
+				return nullptr; // full
+			}
+
+			if (head_.compare_exchange_weak(head, head + needed, std::memory_order_relaxed))
+			{
+				break;
+			}
+		}
+
+		if (to_end < total)
+		{
+			block_header* padding = headerAt(head);
+			padding->size_ = static_cast<uint32_t>(to_end);
+			padding->state_.store(kBlockPadding, std::memory_order_release);
+			head += to_end;
+		}
+
+		block_header* block = headerAt(head);
+		block->size_ = static_cast<uint32_t>(total);
+
+		return reinterpret_cast<unsigned char*>(block + 1);
+	}
+
+	/// Producer: publishes a block returned by reserve()
+	void commit(unsigned char* block)
+	{
+		reinterpret_cast<block_header*>(block)[-1].state_.store(kBlockCommitted, std::memory_order_release);
+	}
+
+	/// Consumer: \return the next committed block after the ones already handed out, and its
+	/// size (possibly padded), or nullptr if there is none (yet). Call advance() to move past it
+	const unsigned char* peek(size_t& size)
+	{
+		for (;;)
+		{
+			block_header* block = headerAt(read_pos_);
+			const uint32_t state = block->state_.load(std::memory_order_acquire);
+
+			if (kBlockCommitted == state)
+			{
+				size = block->size_ - sizeof(block_header);
+				return reinterpret_cast<const unsigned char*>(block + 1);
+			}
+
+			if (kBlockPadding != state)
+			{
+				return nullptr; // empty, or the oldest reservation is not committed yet
+			}
+
+			read_pos_ += consume(read_pos_);
+		}
+	}
+
+	/// Consumer: moves past the block returned by the last peek(). It stays readable until release()
+	void advance()
+	{
+		read_pos_ += consume(read_pos_);
+	}
+
+	/// Consumer: gives every block moved past with advance() back to the producers
+	void release()
+	{
+		release(read_pos_);
+	}
+
+	/// Consumer: gives the blocks before position, an earlier read_position(), back to the producers
+	void release(size_t position)
+	{
+		const size_t tail = tail_.load(std::memory_order_relaxed);
+		const size_t released = position - tail;
+
+		if (0 == released)
+		{
+			return;
+		}
+
+		const size_t offset = tail & mask_;
+		const size_t first = (released < (mask_ + 1) - offset) ? released : (mask_ + 1) - offset;
+		std::memset(&buffer_[offset], 0, first);
+		std::memset(&buffer_[0], 0, released - first);
+
+		tail_.store(position, std::memory_order_release);
+	}
+
+	/// Consumer: end of the blocks moved past with advance()
+	size_t read_position() const
+	{
+		return read_pos_;
+	}
+
+	/// Consumer: end of the blocks reserved so far. Once read_position() has reached it (see
+	/// reached()), every one of them was handed out, waiting for the ones still being written
+	size_t write_position() const
+	{
+		return head_.load(std::memory_order_acquire);
+	}
+
+	/// true if position is at or past bound, positions wrap around
+	static bool reached(size_t position, size_t bound)
+	{
+		return static_cast<ptrdiff_t>(position - bound) >= 0;
+	}
+
+	/// approximate when called concurrently with producers
+	bool empty() const
+	{
+		return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire);
+	}
+
+	/// bytes taken by blocks not released yet, padding included. Approximate from other threads
+	size_t used_bytes() const
+	{
+		const size_t tail = tail_.load(std::memory_order_acquire); // first: the head never falls behind it
+		return head_.load(std::memory_order_acquire) - tail;
+	}
+
+	size_t capacity() const
+	{
+		return mask_ + 1;
+	}
+
+	/// the ring memory, capacity() bytes, e.g. to place it on a NUMA node
+	const void* storage() const
+	{
+		return buffer_.get();
+	}
+};
+
+#endif
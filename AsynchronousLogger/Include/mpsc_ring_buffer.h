@@ -0,0 +1,210 @@
+/** ==========================================================================
+* Bounded lock-free ring buffer for many producers and one consumer.
+*
+* Every cell carries a sequence number which tells producers and the consumer
+* whether the cell is free for writing or holds a published item, so neither
+* side ever takes a lock. Producers only contend on one atomic increment of the
+* enqueue position; the consumer drains published items in batches.
+*
+* This is based on Dmitry Vyukov's bounded MPMC queue
+* Ref: http://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+* ********************************************* */
+
+#ifndef MPSC_RING_BUFFER_H_
+#define MPSC_RING_BUFFER_H_
+
+#include <atomic>
+#include <memory>
+#include <cstddef>
+#include <thread>
+
+#define RING_BUFFER_CACHE_LINE_SIZE 64
+
+template<typename T>
+class mpsc_ring_buffer
+{
+	struct cell
+	{
+		std::atomic<size_t> sequence_;
+		T data_;
+	};
+
+	// positions live on their own cache lines so producers and the consumer do not false share
+	alignas(RING_BUFFER_CACHE_LINE_SIZE) std::atomic<size_t> enqueue_pos_;
+	alignas(RING_BUFFER_CACHE_LINE_SIZE) std::atomic<size_t> dequeue_pos_;
+	alignas(RING_BUFFER_CACHE_LINE_SIZE) std::unique_ptr<cell[]> buffer_;
+	size_t mask_;
+
+	mpsc_ring_buffer(const mpsc_ring_buffer&); // c++11 feature not yet in vs2010 = delete;
+	mpsc_ring_buffer& operator=(const mpsc_ring_buffer&); // c++11 feature not yet in vs2010 = delete;
+
+	static size_t roundUpToPowerOfTwo(size_t value)
+	{
+		size_t result = 2;
+
+		while (result < value)
+		{
+			result <<= 1;
+		}
+
+		return result;
+	}
+
+public:
+
+	/// \param capacity is rounded up to the next power of two
+	explicit mpsc_ring_buffer(size_t capacity)
+		: enqueue_pos_(0)
+		, dequeue_pos_(0)
+		, buffer_(new cell[roundUpToPowerOfTwo(capacity)])
+		, mask_(roundUpToPowerOfTwo(capacity) - 1)
+	{
+		for (size_t i = 0; i <= mask_; ++i)
+		{
+			buffer_[i].sequence_.store(i, std::memory_order_relaxed);
+		}
+	}
+
+	/// \return immediately, false if the ring is full. The item is only moved from on success
+	bool try_push(T&& item)
+	{
+		cell* target = nullptr;
+		size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+
+		for (;;)
+		{
+			target = &buffer_[pos & mask_];
+			const size_t seq = target->sequence_.load(std::memory_order_acquire);
+			const ptrdiff_t diff = static_cast<ptrdiff_t>(seq) - static_cast<ptrdiff_t>(pos);
+
+			if (0 == diff)
+			{
+				if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				{
+					break;
+				}
+			}
+			else if (diff < 0)
+			{
+				return false; // full
+			}
+			else
+			{
+				pos = enqueue_pos_.load(std::memory_order_relaxed);
+			}
+		}
+
+		target->data_ = std::move(item);
+		target->sequence_.store(pos + 1, std::memory_order_release);
+
+		return true;
+	}
+
+	bool try_push(const T& item)
+	{
+		T copy(item);
+		return try_push(std::move(copy));
+	}
+
+	/// Pushes the item, yielding the calling thread while the ring is full
+	void push(T&& item)
+	{
+		while (!try_push(std::move(item)))
+		{
+			std::this_thread::yield();
+		}
+	}
+
+	/// \return immediately, with true if successful retrieval
+	bool try_pop(T& popped_item)
+	{
+		cell* source = nullptr;
+		size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+
+		for (;;)
+		{
+			source = &buffer_[pos & mask_];
+			const size_t seq = source->sequence_.load(std::memory_order_acquire);
+			const ptrdiff_t diff = static_cast<ptrdiff_t>(seq) - static_cast<ptrdiff_t>(pos + 1);
+
+			if (0 == diff)
+			{
+				if (dequeue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				{
+					break;
+				}
+			}
+			else if (diff < 0)
+			{
+				return false; // empty, or the next producer has not published yet
+			}
+			else
+			{
+				pos = dequeue_pos_.load(std::memory_order_relaxed);
+			}
+		}
+
+		popped_item = std::move(source->data_);
+		source->data_ = T();
+		source->sequence_.store(pos + mask_ + 1, std::memory_order_release);
+
+		return true;
+	}
+
+	/// Appends up to max_items published items to the container (anything with push_back)
+	/// \return number of items retrieved
+	template<typename Container>
+	size_t pop_batch(Container& out, size_t max_items)
+	{
+		size_t count = 0;
+		T item;
+
+		while (count < max_items && try_pop(item))
+		{
+			out.push_back(std::move(item));
+			++count;
+		}
+
+		return count;
+	}
+
+	/// approximate when called concurrently with producers
+	bool empty() const
+	{
+		return size() == 0;
+	}
+
+	/// approximate when called concurrently with producers
+	size_t size() const
+	{
+		const size_t enqueued = enqueue_pos_.load(std::memory_order_acquire);
+		const size_t dequeued = dequeue_pos_.load(std::memory_order_acquire);
+
+		return (enqueued > dequeued) ? (enqueued - dequeued) : 0;
+	}
+
+	size_t capacity() const
+	{
+		return mask_ + 1;
+	}
+
+	/// Consumer: the items enqueued so far end here. Once dequeue_position() has reached it,
+	/// every one of them was popped (see reached())
+	size_t enqueue_position() const
+	{
+		return enqueue_pos_.load(std::memory_order_acquire);
+	}
+
+	size_t dequeue_position() const
+	{
+		return dequeue_pos_.load(std::memory_order_relaxed);
+	}
+
+	/// true if position is at or past bound, positions wrap around
+	static bool reached(size_t position, size_t bound)
+	{
+		return static_cast<ptrdiff_t>(position - bound) >= 0;
+	}
+};
+
+#endif
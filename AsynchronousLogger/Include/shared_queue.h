@@ -44,6 +44,7 @@ class shared_queue
 	std::queue<T> queue_;
 	critical_section m_;
 	std::condition_variable_any data_cond_;
+	unsigned waiting_; // consumers blocked on data_cond_, under m_. push() only notifies when there is one
 
 public:
 
@@ -55,6 +56,7 @@ public:
 	}
 
 	shared_queue(const shared_queue& other)
+		: waiting_(0)
 	{
 		queue_ = other.queue_;
 	}
@@ -62,22 +64,33 @@ public:
 public:
 
 	shared_queue()
+		: waiting_(0)
 	{
 
 	}
 
-	void push(T item)
+	void push(const T& item)
+	{
+		push(T(item));
+	}
+
+	void push(T&& item)
 	{
 		try
 		{
 			{
 				std::unique_lock<critical_section> lock(m_);
 
-				queue_.push(item);
+				queue_.push(std::move(item));
+
+				const bool consumer_waiting = (waiting_ > 0);
 
 				lock.unlock(); //Unlock the mutex
 
-				data_cond_.notify_one();
+				if (consumer_waiting)
+				{
+					data_cond_.notify_one(); // a busy consumer finds the item without the syscall
+				}
 			}
 		}
 		catch(...)
@@ -122,7 +135,9 @@ public:
 
 			while(queue_.empty())
 			{ //                       The 'while' loop below is equal to
+				++waiting_;
 				data_cond_.wait(lock);  //data_cond_.wait(lock, [](bool result){return !queue_.empty();});
+				--waiting_;
 			}
 
 			popped_item = std::move(queue_.front());
@@ -147,7 +162,11 @@ public:
 
 			if(queue_.empty())
 			{
-				if(std::cv_status::no_timeout != data_cond_.wait_for(lock, shared_queue_globals::default_wait))
+				++waiting_;
+				const std::cv_status status = data_cond_.wait_for(lock, shared_queue_globals::default_wait);
+				--waiting_;
+
+				if(std::cv_status::no_timeout != status)
 				{
 					if (!queue_.empty())
 					{
@@ -184,7 +203,11 @@ public:
 
 			if(queue_.empty())
 			{
-				if(std::cv_status::no_timeout != data_cond_.wait_for(lock, wait_duration * shared_queue_globals::sec))
+				++waiting_;
+				const std::cv_status status = data_cond_.wait_for(lock, wait_duration * shared_queue_globals::sec);
+				--waiting_;
+
+				if(std::cv_status::no_timeout != status)
 				{
 					if (!queue_.empty())
 					{
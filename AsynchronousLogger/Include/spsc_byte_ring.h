@@ -0,0 +1,224 @@
+/** ==========================================================================
+* Bounded lock-free byte ring for one producer and one consumer.
+*
+* Holds variable-length blocks back to back in one contiguous buffer. The
+* producer reserves a block, writes it in place and commits it; the consumer
+* peeks the oldest block, reads it in place, moves past it and releases the
+* blocks it is done with, one by one or many at once. A block never
+* wraps: when it does not fit before the end of the buffer, the rest of the
+* buffer is skipped with a padding block.
+*
+* Each side keeps a cached copy of the other side's position, so the shared
+* positions are only read when the cached one says the ring is full/empty.
+* ********************************************* */
+
+#ifndef SPSC_BYTE_RING_H_
+#define SPSC_BYTE_RING_H_
+
+#include <atomic>
+#include <memory>
+#include <cstddef>
+#include <cstdint>
+
+#include "mpsc_ring_buffer.h" // RING_BUFFER_CACHE_LINE_SIZE
+
+class spsc_byte_ring
+{
+	struct block_header
+	{
+		uint32_t size_;    // whole block including this header
+		uint32_t padding_; // non zero: skip to the start of the buffer
+	};
+
+	static const size_t kBlockAlignment = 8;
+
+	std::unique_ptr<unsigned char[]> buffer_;
+	size_t mask_;
+
+	// producer side
+	alignas(RING_BUFFER_CACHE_LINE_SIZE) std::atomic<size_t> head_;
+	size_t cached_tail_;
+	size_t reserved_head_;
+
+	// consumer side
+	alignas(RING_BUFFER_CACHE_LINE_SIZE) std::atomic<size_t> tail_;
+	size_t cached_head_;
+	size_t read_pos_; // end of the blocks handed out by peek()/advance(), not yet released
+	size_t peeked_size_;
+
+	spsc_byte_ring(const spsc_byte_ring&); // c++11 feature not yet in vs2010 = delete;
+	spsc_byte_ring& operator=(const spsc_byte_ring&); // c++11 feature not yet in vs2010 = delete;
+
+	static size_t roundUpToPowerOfTwo(size_t value)
+	{
+		size_t result = 64;
+
+		while (result < value)
+		{
+			result <<= 1;
+		}
+
+		return result;
+	}
+
+	block_header* headerAt(size_t position) const
+	{
+		return reinterpret_cast<block_header*>(&buffer_[position & mask_]);
+	}
+
+public:
+
+	/// \param capacity in bytes, rounded up to the next power of two
+	explicit spsc_byte_ring(size_t capacity)
+		: buffer_(new unsigned char[roundUpToPowerOfTwo(capacity)])
+		, mask_(roundUpToPowerOfTwo(capacity) - 1)
+		, head_(0)
+		, cached_tail_(0)
+		, reserved_head_(0)
+		, tail_(0)
+		, cached_head_(0)
+		, read_pos_(0)
+		, peeked_size_(0)
+	{
+	}
+
+	/// largest payload reserve() can ever succeed with
+	size_t max_block_size() const
+	{
+		return (mask_ + 1) / 2 - sizeof(block_header);
+	}
+
+	/// Producer: \return kBlockAlignment aligned space for size bytes, or nullptr if the ring is full.
+	/// The block becomes visible to the consumer with commit()
+	unsigned char* reserve(size_t size)
+	{
+		if (size > max_block_size())
+		{
+			return nullptr;
+		}
+
+		const size_t capacity = mask_ + 1;
+		const size_t total = (sizeof(block_header) + size + kBlockAlignment - 1) & ~(kBlockAlignment - 1);
+		size_t head = head_.load(std::memory_order_relaxed);
+		const size_t to_end = capacity - (head & mask_);
+		const size_t needed = (to_end < total) ? to_end + total : total;
+
+		if (head + needed - cached_tail_ > capacity)
+		{
+			cached_tail_ = tail_.load(std::memory_order_acquire);
+
+			if (head + needed - cached_tail_ > capacity)
+			{
+				return nullptr; // full
+			}
+		}
+
+		if (to_end < total)
+		{
+			block_header* padding = headerAt(head);
+			padding->size_ = static_cast<uint32_t>(to_end);
+			padding->padding_ = 1;
+			head += to_end;
+		}
+
+		block_header* block = headerAt(head);
+		block->size_ = static_cast<uint32_t>(total);
+		block->padding_ = 0;
+		reserved_head_ = head + total;
+
+		return reinterpret_cast<unsigned char*>(block + 1);
+	}
+
+	/// Producer: publishes the block returned by the last reserve()
+	void commit()
+	{
+		head_.store(reserved_head_, std::memory_order_release);
+	}
+
+	/// Consumer: \return the oldest committed block not handed out yet and its size (possibly padded),
+	/// or nullptr if there is none. Call advance() to move past it
+	const unsigned char* peek(size_t& size)
+	{
+		for (;;)
+		{
+			if (read_pos_ == cached_head_)
+			{
+				cached_head_ = head_.load(std::memory_order_acquire);
+
+				if (read_pos_ == cached_head_)
+				{
+					return nullptr; // empty
+				}
+			}
+
+			const block_header* block = headerAt(read_pos_);
+
+			if (0 == block->padding_)
+			{
+				peeked_size_ = block->size_;
+				size = block->size_ - sizeof(block_header);
+				return reinterpret_cast<const unsigned char*>(block + 1);
+			}
+
+			read_pos_ += block->size_;
+		}
+	}
+
+	/// Consumer: moves past the block returned by the last peek(). It stays readable until released
+	void advance()
+	{
+		read_pos_ += peeked_size_;
+		peeked_size_ = 0;
+	}
+
+	/// Consumer: gives every block moved past with advance() back to the producer
+	void release()
+	{
+		tail_.store(read_pos_, std::memory_order_release);
+	}
+
+	/// Consumer: gives the blocks before position, an earlier read_position(), back to the producer
+	void release(size_t position)
+	{
+		tail_.store(position, std::memory_order_release);
+	}
+
+	/// Consumer: end of the blocks moved past with advance()
+	size_t read_position() const
+	{
+		return read_pos_;
+	}
+
+	/// Consumer: end of the blocks committed so far. Once read_position() has reached it (see
+	/// reached()), every one of them was handed out
+	size_t write_position() const
+	{
+		return head_.load(std::memory_order_acquire);
+	}
+
+	/// true if position is at or past bound, positions wrap around
+	static bool reached(size_t position, size_t bound)
+	{
+		return static_cast<ptrdiff_t>(position - bound) >= 0;
+	}
+
+	/// approximate unless called from the consumer
+	bool empty() const
+	{
+		return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire);
+	}
+
+	/// bytes taken by blocks not released yet, padding included. Approximate from other threads
+	size_t used_bytes() const
+	{
+		const size_t tail = tail_.load(std::memory_order_acquire); // first: the head never falls behind it
+		return head_.load(std::memory_order_acquire) - tail;
+	}
+
+	size_t capacity() const
+	{
+		return mask_ + 1;
+	}
+};
+
+#endif
@@ -0,0 +1,228 @@
+/** ==========================================================================
+* Filename:allocation_benchmark.cpp  Heap allocations and cache misses of one log message
+*
+* Counts, per message and for each logging API, what it takes to go from the
+* LOG statement to the log file: the LogMessage on the calling thread and the
+* queueing, formatting and file write on the background thread.
+*   - heap allocations and bytes allocated: the global operator new / delete are
+*     replaced by the counting versions of allocation_counter.h
+*   - instructions, L1 data cache read misses and last level cache misses of the
+*     process (user space), from perf_event_open on Linux. Elsewhere, or when
+*     the kernel does not allow it (perf_event_paranoid), they read n/a
+*
+* Each API is measured over the whole life of a worker, once with
+* BENCHMARK_MESSAGES and once with BENCHMARK_BASELINE_MESSAGES messages. The
+* difference divided by the difference in messages is the cost of one message:
+* the start up and shut down of the worker, the first use of a call site and
+* the thread locals cancel out. The worker is destroyed inside the measured
+* window so that its background thread has written everything and, for the
+* inherited hardware counters, has exited and handed its counts over.
+* ********************************************* */
+
+#include "stdafx.h"
+
+#include "benchmark.h"
+#include "allocation_counter.h"
+
+#include <cstdio>
+
+#if !(defined(WIN32) || defined(_WIN32) || defined(__WIN32__)) && defined(__linux__)
+#define BENCHMARK_USE_PERF_EVENTS
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cstring>
+#endif
+
+#define BENCHMARK_MESSAGES 100000
+#define BENCHMARK_BASELINE_MESSAGES 1000
+
+using namespace benchmark;
+
+namespace
+{
+enum HardwareCounter
+{
+	kInstructions,
+	kL1DataReadMisses,
+	kLastLevelCacheMisses,
+	kHardwareCounters
+};
+
+const char* const hardware_counter_names[kHardwareCounters] = {"instructions", "L1d misses", "LLC misses"};
+
+// Counters of this process, user space only, inherited by the threads started while they are open.
+// The counts of such a thread are added when it exits
+class HardwareCounters
+{
+public:
+	HardwareCounters()
+	{
+		for (int i = 0; i < kHardwareCounters; ++i)
+		{
+			fds_[i] = -1;
+		}
+	}
+
+	~HardwareCounters()
+	{
+		close();
+	}
+
+	/// \return false if no counter could be opened
+	bool open()
+	{
+		bool any = false;
+#ifdef BENCHMARK_USE_PERF_EVENTS
+		const unsigned long long configs[kHardwareCounters][2] = {
+			{PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+			{PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+			{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES}};
+
+		for (int i = 0; i < kHardwareCounters; ++i)
+		{
+			perf_event_attr attr;
+			std::memset(&attr, 0, sizeof(attr));
+			attr.size = sizeof(attr);
+			attr.type = static_cast<unsigned int>(configs[i][0]);
+			attr.config = configs[i][1];
+			attr.disabled = 1;
+			attr.inherit = 1;
+			attr.exclude_kernel = 1;
+			attr.exclude_hv = 1;
+
+			fds_[i] = static_cast<int>(::syscall(__NR_perf_event_open, &attr, 0 /* this process */, -1 /* any cpu */, -1, 0));
+			any = any || fds_[i] >= 0;
+		}
+#endif
+		return any;
+	}
+
+	void start()
+	{
+#ifdef BENCHMARK_USE_PERF_EVENTS
+		for (int i = 0; i < kHardwareCounters; ++i)
+		{
+			if (fds_[i] >= 0)
+			{
+				::ioctl(fds_[i], PERF_EVENT_IOC_RESET, 0);
+				::ioctl(fds_[i], PERF_EVENT_IOC_ENABLE, 0);
+			}
+		}
+#endif
+	}
+
+	/// stops the counters, values[i] is -1 for a counter that is not available
+	void stop(long long values[kHardwareCounters])
+	{
+		for (int i = 0; i < kHardwareCounters; ++i)
+		{
+			values[i] = -1;
+#ifdef BENCHMARK_USE_PERF_EVENTS
+			unsigned long long count = 0;
+			if (fds_[i] >= 0)
+			{
+				::ioctl(fds_[i], PERF_EVENT_IOC_DISABLE, 0);
+				if (sizeof(count) == ::read(fds_[i], &count, sizeof(count)))
+				{
+					values[i] = static_cast<long long>(count);
+				}
+			}
+#endif
+		}
+	}
+
+	void close()
+	{
+#ifdef BENCHMARK_USE_PERF_EVENTS
+		for (int i = 0; i < kHardwareCounters; ++i)
+		{
+			if (fds_[i] >= 0)
+			{
+				::close(fds_[i]);
+				fds_[i] = -1;
+			}
+		}
+#endif
+	}
+
+private:
+	int fds_[kHardwareCounters];
+};
+
+struct Measurement
+{
+	unsigned long long allocations;
+	unsigned long long allocated_bytes;
+	long long hardware[kHardwareCounters];
+};
+
+// a whole worker life with messages LOG calls, on this thread
+Measurement measure(LogApi api, int messages, HardwareCounters& counters)
+{
+	Measurement result;
+	const unsigned long long allocations_before = g_allocations.load();
+	const unsigned long long bytes_before = g_allocated_bytes.load();
+	counters.start();
+
+	{
+		BenchmarkWorker worker(_T("allocation_benchmark"));
+
+		for (int i = 0; i < messages; ++i)
+		{
+			logOnce(api, i);
+		}
+	} // the background thread writes every record, then exits
+
+	counters.stop(result.hardware);
+	result.allocations = g_allocations.load() - allocations_before;
+	result.allocated_bytes = g_allocated_bytes.load() - bytes_before;
+	return result;
+}
+
+void printPerMessage(long long full, long long baseline)
+{
+	if (full < 0 || baseline < 0)
+	{
+		std::printf(" %14s", "n/a");
+		return;
+	}
+	std::printf(" %14.2f", static_cast<double>(full - baseline) / (BENCHMARK_MESSAGES - BENCHMARK_BASELINE_MESSAGES));
+}
+} // anonymous
+
+
+int main()
+{
+	HardwareCounters counters;
+	const bool hardware = counters.open();
+
+	std::printf("per message, from the LOG statement to the file (%d - %d messages)%s\n\n", BENCHMARK_MESSAGES, BENCHMARK_BASELINE_MESSAGES,
+	            hardware ? "" : ", no hardware counters: not Linux or perf_event_paranoid too high");
+	std::printf("%-20s %14s %14s", "api", "allocations", "bytes");
+	for (int i = 0; i < kHardwareCounters; ++i)
+	{
+		std::printf(" %14s", hardware_counter_names[i]);
+	}
+	std::printf("\n");
+
+	const LogApi apis[] = {kLogStream, kLogPrintf, kLogDeferred, kLogDisabled};
+
+	for (size_t a = 0; a < sizeof(apis) / sizeof(apis[0]); ++a)
+	{
+		const Measurement baseline = measure(apis[a], BENCHMARK_BASELINE_MESSAGES, counters);
+		const Measurement full = measure(apis[a], BENCHMARK_MESSAGES, counters);
+
+		std::printf("%-20s", apiName(apis[a]));
+		printPerMessage(static_cast<long long>(full.allocations), static_cast<long long>(baseline.allocations));
+		printPerMessage(static_cast<long long>(full.allocated_bytes), static_cast<long long>(baseline.allocated_bytes));
+		for (int i = 0; i < kHardwareCounters; ++i)
+		{
+			printPerMessage(full.hardware[i], baseline.hardware[i]);
+		}
+		std::printf("\n");
+	}
+
+	return 0;
+}
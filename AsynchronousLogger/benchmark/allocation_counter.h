@@ -0,0 +1,79 @@
+/** ==========================================================================
+* Filename:allocation_counter.h  Counting replacements of the global operator new / delete
+*
+* Defines the replaceable global allocation functions, so it is included by
+* exactly one translation unit of a program. Every thread is counted.
+* ********************************************* */
+
+#ifndef Async_ALLOCATION_COUNTER_H_
+#define Async_ALLOCATION_COUNTER_H_
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+namespace benchmark
+{
+std::atomic<unsigned long long> g_allocations(0);
+std::atomic<unsigned long long> g_allocated_bytes(0);
+
+inline void* countedAllocation(size_t size)
+{
+	g_allocations.fetch_add(1, std::memory_order_relaxed);
+	g_allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+	return std::malloc(size ? size : 1);
+}
+
+inline void countedFree(void* memory)
+{
+	std::free(memory);
+}
+} // benchmark
+
+
+void* operator new(size_t size)
+{
+	void* memory = benchmark::countedAllocation(size);
+	if (!memory)
+	{
+		throw std::bad_alloc();
+	}
+	return memory;
+}
+
+void* operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) throw()
+{
+	return benchmark::countedAllocation(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) throw()
+{
+	return benchmark::countedAllocation(size);
+}
+
+void operator delete(void* memory) throw()
+{
+	benchmark::countedFree(memory);
+}
+
+void operator delete[](void* memory) throw()
+{
+	benchmark::countedFree(memory);
+}
+
+void operator delete(void* memory, const std::nothrow_t&) throw()
+{
+	benchmark::countedFree(memory);
+}
+
+void operator delete[](void* memory, const std::nothrow_t&) throw()
+{
+	benchmark::countedFree(memory);
+}
+
+#endif // Async_ALLOCATION_COUNTER_H_
@@ -0,0 +1,101 @@
+/** ==========================================================================
+* Filename:benchmark.h  Shared pieces of the benchmark programs
+*
+* Every program in this directory is one translation unit, built by the console
+* project next to it that links the AsyncLogger library, and is run from a
+* directory where the log files may be written. Include this header after
+* stdafx.h.
+* ********************************************* */
+
+#ifndef Async_BENCHMARK_H_
+#define Async_BENCHMARK_H_
+
+#include "Asynclogworker.h"
+#include "Asynclog.h"
+
+#include <chrono>
+#include <vector>
+
+namespace benchmark
+{
+typedef std::chrono::steady_clock bench_clock;
+
+enum LogApi
+{
+	kLogStream,
+	kLogPrintf,
+	kLogDeferred,
+	kLogDisabled
+};
+
+inline const char* apiName(LogApi api)
+{
+	switch (api)
+	{
+	case kLogStream:   return "LOG(INFO) <<";
+	case kLogPrintf:   return "LOGF(INFO)";
+	case kLogDeferred: return "LOGF_DEFER(INFO)";
+	default:           return "LOG(DBUG) disabled";
+	}
+}
+
+// one call site per API: a loop reuses it, as a hot LOG statement would
+inline void logOnce(LogApi api, int x)
+{
+	switch (api)
+	{
+	case kLogStream:
+		LOG(INFO) << _T("x=") << x;
+		break;
+	case kLogPrintf:
+		LOGF(INFO, _T("x=%d"), x);
+		break;
+	case kLogDeferred:
+		LOGF_DEFER(INFO, _T("x=%d"), x);
+		break;
+	default:
+		LOG(DBUG) << _T("x=") << x;
+		break;
+	}
+}
+
+/// the value at fraction (0 ... 1) of sorted samples, 0 if there are none
+template <typename Sample>
+double percentile(const std::vector<Sample>& sorted, double fraction)
+{
+	if (sorted.empty())
+	{
+		return 0.0;
+	}
+	const size_t index = static_cast<size_t>(fraction * (sorted.size() - 1));
+	return static_cast<double>(sorted[index]);
+}
+
+/// An AsyncLogWorker writing name*.log to the working directory, initialized for logging
+class BenchmarkWorker
+{
+public:
+	explicit BenchmarkWorker(const tstring& name, UINT level = INFO, const AsyncLogWorkerOptions& options = AsyncLogWorkerOptions())
+		: worker_(name, _T("./"), level, name, _T("1"), options)
+	{
+		AsyncLogger::initializeLogging(&worker_);
+	}
+
+	AsyncLogWorker& worker() { return worker_; }
+
+	/// returns once the background thread has written everything logged so far
+	/// (records are drained before the callbacks queued after them)
+	void waitUntilWritten()
+	{
+		worker_.genericAsyncCall([]() { return 0; }).wait();
+	}
+
+private:
+	BenchmarkWorker(const BenchmarkWorker&); // c++11 feature not yet in vs2010 = delete;
+	BenchmarkWorker& operator=(const BenchmarkWorker&); // c++11 feature not yet in vs2010 = delete;
+
+	AsyncLogWorker worker_;
+};
+} // benchmark
+
+#endif // Async_BENCHMARK_H_
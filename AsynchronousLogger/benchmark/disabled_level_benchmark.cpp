@@ -0,0 +1,86 @@
+/** ==========================================================================
+* Filename:disabled_level_benchmark.cpp  Cost of a LOG statement that does not log
+*
+* Two kinds of disabled statements, against an empty loop doing the same
+* bookkeeping:
+*   - below ASYNCLOG_MIN_LEVEL (INFO for this file): LOG(DBUG) folds away at
+*     compile time
+*   - below the runtime level: LOG(INFO) / LOGF(INFO) / LOGF_DEFER(INFO) while
+*     the level is WARNING, the level cached in the call site checked before
+*     anything else
+* Every statement takes an argument that counts its evaluations, which must
+* stay 0: a disabled statement does not evaluate its arguments.
+* ********************************************* */
+
+#include "stdafx.h"
+
+// after stdafx.h, whatever comes before it is skipped with a precompiled header (/Yu),
+// and before the logger headers
+#define ASYNCLOG_MIN_LEVEL INFO
+
+#include "benchmark.h"
+
+#include <cstdio>
+
+#define BENCHMARK_ITERATIONS 200000000
+#define BENCHMARK_TARGET_NS 1.0
+
+using namespace benchmark;
+
+namespace
+{
+volatile unsigned int g_loop_sink = 0; // keeps every loop, including the empty one
+unsigned long long g_evaluations = 0;
+
+int countedArgument(int value)
+{
+	++g_evaluations;
+	return value;
+}
+
+template <typename Body>
+double nanosecondsPerIteration(Body body)
+{
+	const bench_clock::time_point start = bench_clock::now();
+	for (int i = 0; i < BENCHMARK_ITERATIONS; ++i)
+	{
+		g_loop_sink = i;
+		body(i);
+	}
+	return std::chrono::duration<double, std::nano>(bench_clock::now() - start).count() / BENCHMARK_ITERATIONS;
+}
+} // anonymous
+
+
+int main()
+{
+	BenchmarkWorker worker(_T("disabled_level_benchmark"), WARNING);
+
+	const double empty_ns = nanosecondsPerIteration([](int) {});
+
+	struct Case
+	{
+		const char* name;
+		double ns;
+	} cases[] = {
+		{"LOG(DBUG) compiled out", nanosecondsPerIteration([](int i) { LOG(DBUG) << _T("value ") << countedArgument(i); })},
+		{"LOG(INFO) runtime off", nanosecondsPerIteration([](int i) { LOG(INFO) << _T("value ") << countedArgument(i); })},
+		{"LOGF(INFO) runtime off", nanosecondsPerIteration([](int i) { LOGF(INFO, _T("value %d"), countedArgument(i)); })},
+		{"LOGF_DEFER runtime off", nanosecondsPerIteration([](int i) { LOGF_DEFER(INFO, _T("value %d"), countedArgument(i)); })},
+	};
+
+	std::printf("%d iterations, empty loop %.3f ns per iteration (subtracted)\n\n", BENCHMARK_ITERATIONS, empty_ns);
+	std::printf("%-26s %10s %8s\n", "statement", "ns", "< 1 ns");
+
+	bool all_below_target = true;
+	for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i)
+	{
+		const double cost = cases[i].ns - empty_ns;
+		const bool below_target = cost < BENCHMARK_TARGET_NS;
+		all_below_target = all_below_target && below_target;
+		std::printf("%-26s %10.3f %8s\n", cases[i].name, cost, below_target ? "yes" : "NO");
+	}
+
+	std::printf("\narguments evaluated: %llu (must be 0)\n", g_evaluations);
+	return (all_below_target && 0 == g_evaluations) ? 0 : 1;
+}
@@ -0,0 +1,245 @@
+/** ==========================================================================
+* Filename:producer_latency_benchmark.cpp  Cost of a LOG call on the calling thread
+*
+* For LOG(INFO) <<, LOGF, LOGF_DEFER and a LOG statement below the log level the
+* benchmark runs 1, 2, 4 ... N producer threads (N: the hardware threads, or the
+* second argument) and reports
+*   - the latency of each call: p50 / p90 / p99 / p99.9 / max, timed with the CPU
+*     time stamp counter (rdtsc) on x86, with steady_clock elsewhere. The timer
+*     overhead, measured up front, is reported and not subtracted
+*   - the sustained throughput: messages and MB (as written to the log file) per
+*     second, until the background thread has written the last record
+*
+* A table goes to stdout and the results to a JSON file (first argument, default
+* producer_latency_benchmark.json) so that runs can be compared.
+* ********************************************* */
+
+#include "stdafx.h"
+
+#include "benchmark.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define BENCHMARK_USE_RDTSC
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#endif
+
+#define BENCHMARK_CALLS_PER_THREAD 50000
+#define BENCHMARK_WARMUP_CALLS 2000
+#define BENCHMARK_CALIBRATION_MS 100
+
+using namespace benchmark;
+
+namespace
+{
+typedef unsigned long long bench_ticks;
+
+inline bench_ticks benchTicks()
+{
+#ifdef BENCHMARK_USE_RDTSC
+	return static_cast<bench_ticks>(__rdtsc());
+#else
+	return static_cast<bench_ticks>(std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now().time_since_epoch()).count());
+#endif
+}
+
+// nanoseconds per benchTicks() unit, against steady_clock
+double measureNanosecondsPerTick()
+{
+#ifdef BENCHMARK_USE_RDTSC
+	const bench_clock::time_point wall_start = bench_clock::now();
+	const bench_ticks tick_start = benchTicks();
+	std::this_thread::sleep_for(std::chrono::milliseconds(BENCHMARK_CALIBRATION_MS));
+	const bench_ticks tick_end = benchTicks();
+	const long long wall_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now() - wall_start).count();
+	return (tick_end > tick_start) ? static_cast<double>(wall_ns) / (tick_end - tick_start) : 1.0;
+#else
+	return 1.0;
+#endif
+}
+
+// median of back to back timer reads, in ticks
+bench_ticks measureTimerOverhead()
+{
+	std::vector<bench_ticks> samples(10000);
+	for (size_t i = 0; i < samples.size(); ++i)
+	{
+		const bench_ticks start = benchTicks();
+		samples[i] = benchTicks() - start;
+	}
+	std::sort(samples.begin(), samples.end());
+	return samples[samples.size() / 2];
+}
+
+struct RunResult
+{
+	LogApi api;
+	unsigned int threads;
+	double p50_ns;
+	double p90_ns;
+	double p99_ns;
+	double p999_ns;
+	double max_ns;
+	double msgs_per_sec;
+	double mb_per_sec;
+};
+
+RunResult runProducers(BenchmarkWorker& worker, LogApi api, unsigned int thread_count, double ns_per_tick)
+{
+	std::vector<std::vector<bench_ticks> > latencies(thread_count);
+	std::vector<std::thread> producers;
+	std::atomic<unsigned int> ready(0);
+	std::atomic<bool> go(false);
+
+	worker.waitUntilWritten(); // the previous run is written
+	const unsigned long long bytes_before = worker.worker().stats().bytes_written;
+
+	for (unsigned int t = 0; t < thread_count; ++t)
+	{
+		producers.push_back(std::thread([&, t]() {
+			std::vector<bench_ticks>& samples = latencies[t];
+			samples.resize(BENCHMARK_CALLS_PER_THREAD);
+
+			for (int i = 0; i < BENCHMARK_WARMUP_CALLS; ++i)
+			{
+				logOnce(api, i); // call sites, thread locals, message buffers
+			}
+
+			ready.fetch_add(1);
+			while (!go.load(std::memory_order_acquire))
+			{
+				std::this_thread::yield();
+			}
+
+			for (int i = 0; i < BENCHMARK_CALLS_PER_THREAD; ++i)
+			{
+				const bench_ticks start = benchTicks();
+				logOnce(api, i);
+				samples[i] = benchTicks() - start;
+			}
+		}));
+	}
+
+	while (ready.load() != thread_count)
+	{
+		std::this_thread::yield();
+	}
+	worker.waitUntilWritten(); // the warm up records are written
+
+	const unsigned long long warmup_bytes = worker.worker().stats().bytes_written - bytes_before;
+	const bench_clock::time_point start = bench_clock::now();
+	go.store(true, std::memory_order_release);
+
+	for (size_t t = 0; t < producers.size(); ++t)
+	{
+		producers[t].join();
+	}
+	worker.waitUntilWritten(); // sustained: until the background thread wrote them all
+
+	const double seconds = std::chrono::duration<double>(bench_clock::now() - start).count();
+	const unsigned long long bytes = worker.worker().stats().bytes_written - bytes_before - warmup_bytes;
+
+	std::vector<bench_ticks> all;
+	all.reserve(static_cast<size_t>(thread_count) * BENCHMARK_CALLS_PER_THREAD);
+	for (size_t t = 0; t < latencies.size(); ++t)
+	{
+		all.insert(all.end(), latencies[t].begin(), latencies[t].end());
+	}
+	std::sort(all.begin(), all.end());
+
+	RunResult result;
+	result.api = api;
+	result.threads = thread_count;
+	result.p50_ns = percentile(all, 0.50) * ns_per_tick;
+	result.p90_ns = percentile(all, 0.90) * ns_per_tick;
+	result.p99_ns = percentile(all, 0.99) * ns_per_tick;
+	result.p999_ns = percentile(all, 0.999) * ns_per_tick;
+	result.max_ns = all.empty() ? 0.0 : all.back() * ns_per_tick;
+	result.msgs_per_sec = seconds > 0 ? all.size() / seconds : 0.0;
+	result.mb_per_sec = seconds > 0 ? bytes / seconds / (1024.0 * 1024.0) : 0.0;
+	return result;
+}
+
+bool writeJson(const char* path, const std::vector<RunResult>& results, double ns_per_tick, double timer_overhead_ns)
+{
+	FILE* out = std::fopen(path, "w");
+	if (!out)
+	{
+		return false;
+	}
+
+	std::fprintf(out, "{\n  \"benchmark\": \"producer_latency\",\n");
+#ifdef BENCHMARK_USE_RDTSC
+	std::fprintf(out, "  \"timer\": \"rdtsc\",\n");
+#else
+	std::fprintf(out, "  \"timer\": \"steady_clock\",\n");
+#endif
+	std::fprintf(out, "  \"ns_per_tick\": %.6f,\n  \"timer_overhead_ns\": %.2f,\n", ns_per_tick, timer_overhead_ns);
+	std::fprintf(out, "  \"calls_per_thread\": %d,\n  \"results\": [\n", BENCHMARK_CALLS_PER_THREAD);
+
+	for (size_t i = 0; i < results.size(); ++i)
+	{
+		const RunResult& r = results[i];
+		std::fprintf(out, "    {\"api\": \"%s\", \"threads\": %u, \"p50_ns\": %.1f, \"p90_ns\": %.1f, \"p99_ns\": %.1f, "
+		                  "\"p99_9_ns\": %.1f, \"max_ns\": %.1f, \"msgs_per_sec\": %.0f, \"mb_per_sec\": %.2f}%s\n",
+		             apiName(r.api), r.threads, r.p50_ns, r.p90_ns, r.p99_ns, r.p999_ns, r.max_ns, r.msgs_per_sec, r.mb_per_sec,
+		             (i + 1 < results.size()) ? "," : "");
+	}
+
+	std::fprintf(out, "  ]\n}\n");
+	std::fclose(out);
+	return true;
+}
+} // anonymous
+
+
+int main(int argc, char** argv)
+{
+	const char* json_path = (argc > 1) ? argv[1] : "producer_latency_benchmark.json";
+	unsigned int max_threads = (argc > 2) ? static_cast<unsigned int>(std::atoi(argv[2])) : std::thread::hardware_concurrency();
+	if (0 == max_threads)
+	{
+		max_threads = 1;
+	}
+
+	const double ns_per_tick = measureNanosecondsPerTick();
+	const double timer_overhead_ns = measureTimerOverhead() * ns_per_tick;
+
+	BenchmarkWorker worker(_T("producer_latency_benchmark"));
+
+	std::printf("%d calls per thread, timer overhead %.1f ns (included)\n\n", BENCHMARK_CALLS_PER_THREAD, timer_overhead_ns);
+	std::printf("%-20s %7s %9s %9s %9s %9s %11s %12s %8s\n", "api", "threads", "p50 ns", "p90 ns", "p99 ns", "p99.9 ns", "max ns", "msgs/s", "MB/s");
+
+	const LogApi apis[] = {kLogStream, kLogPrintf, kLogDeferred, kLogDisabled};
+	std::vector<RunResult> results;
+
+	for (size_t a = 0; a < sizeof(apis) / sizeof(apis[0]); ++a)
+	{
+		for (unsigned int threads = 1; threads <= max_threads; threads = (threads * 2 > max_threads && threads < max_threads) ? max_threads : threads * 2)
+		{
+			const RunResult r = runProducers(worker, apis[a], threads, ns_per_tick);
+			std::printf("%-20s %7u %9.1f %9.1f %9.1f %9.1f %11.1f %12.0f %8.2f\n", apiName(r.api), r.threads,
+			            r.p50_ns, r.p90_ns, r.p99_ns, r.p999_ns, r.max_ns, r.msgs_per_sec, r.mb_per_sec);
+			results.push_back(r);
+		}
+	}
+
+	if (!writeJson(json_path, results, ns_per_tick, timer_overhead_ns))
+	{
+		std::fprintf(stderr, "cannot write %s\n", json_path);
+		return 1;
+	}
+
+	std::printf("\nresults written to %s\n", json_path);
+	return 0;
+}
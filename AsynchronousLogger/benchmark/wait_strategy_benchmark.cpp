@@ -0,0 +1,140 @@
+/** ==========================================================================
+* Filename:wait_strategy_benchmark.cpp  CPU usage and latency of each ActiveWaitStrategy
+*
+* For every wait strategy of the background thread the benchmark measures
+*   - the CPU time of the process while nothing is logged (idle cost)
+*   - the CPU time while one thread logs at a steady rate
+*   - the LOG-to-file latency: from the LOG call until the background thread has
+*     written and flushed the record. A genericAsyncCall queued right after the
+*     record runs once the record is written (records are drained before
+*     callbacks) and stamps the time; the caller polls its future without sleeping
+* ********************************************* */
+
+#include "stdafx.h"
+
+#include "benchmark.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <thread>
+
+#if !(defined(WIN32) || defined(_WIN32) || defined(__WIN32__))
+#include <sys/resource.h>
+#endif
+
+#define BENCHMARK_IDLE_MS 1000
+#define BENCHMARK_RECORDS 5000
+#define BENCHMARK_RECORD_INTERVAL_US 200
+
+using namespace benchmark;
+
+namespace
+{
+// user + system time of the whole process, in microseconds
+long long processCpuMicroseconds()
+{
+#if (defined(WIN32) || defined(_WIN32) || defined(__WIN32__))
+	FILETIME creation, exit, kernel, user;
+	if (!::GetProcessTimes(::GetCurrentProcess(), &creation, &exit, &kernel, &user))
+	{
+		return 0;
+	}
+	ULARGE_INTEGER kernel_time, user_time;
+	kernel_time.LowPart = kernel.dwLowDateTime;
+	kernel_time.HighPart = kernel.dwHighDateTime;
+	user_time.LowPart = user.dwLowDateTime;
+	user_time.HighPart = user.dwHighDateTime;
+	return static_cast<long long>((kernel_time.QuadPart + user_time.QuadPart) / 10); // 100 ns units
+#else
+	rusage usage;
+	if (0 != getrusage(RUSAGE_SELF, &usage))
+	{
+		return 0;
+	}
+	return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000LL + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+#endif
+}
+
+// CPU time of the process over wall time, in percent of one core
+class CpuMeter
+{
+public:
+	CpuMeter() : cpu_start_(processCpuMicroseconds()), wall_start_(bench_clock::now()) {}
+
+	double percent() const
+	{
+		const long long wall_us = std::chrono::duration_cast<std::chrono::microseconds>(bench_clock::now() - wall_start_).count();
+		return wall_us ? 100.0 * (processCpuMicroseconds() - cpu_start_) / wall_us : 0.0;
+	}
+
+private:
+	long long cpu_start_;
+	bench_clock::time_point wall_start_;
+};
+
+void runStrategy(const char* name, AsyncLogger::ActiveWaitStrategy strategy)
+{
+	AsyncLogWorkerOptions options;
+	options.wait_policy.strategy = strategy;
+	if (AsyncLogger::kBusySpin == strategy)
+	{
+		options.thread_options.cpus.push_back(0); // a spinning thread should own its core
+	}
+
+	BenchmarkWorker worker(_T("wait_strategy_benchmark"), INFO, options);
+
+	FlushPolicy flush_policy;
+	flush_policy.flush_level = INFO; // every record goes to the OS right away: measures LOG to file
+	worker.worker().setFlushPolicy(flush_policy);
+
+	worker.waitUntilWritten(); // the init text is written
+
+	CpuMeter idle_meter;
+	std::this_thread::sleep_for(std::chrono::milliseconds(BENCHMARK_IDLE_MS));
+	const double idle_cpu = idle_meter.percent();
+
+	std::vector<long long> latencies_ns;
+	latencies_ns.reserve(BENCHMARK_RECORDS);
+	std::atomic<long long> written_at_ns(0);
+
+	CpuMeter load_meter;
+	for (int i = 0; i < BENCHMARK_RECORDS; ++i)
+	{
+		const bench_clock::time_point logged_at = bench_clock::now();
+		LOG(INFO) << _T("wait strategy benchmark record ") << i;
+
+		std::future<int> written = worker.worker().genericAsyncCall([&written_at_ns]() {
+			written_at_ns.store(std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now().time_since_epoch()).count(), std::memory_order_release);
+			return 0;
+		});
+		while (std::future_status::ready != written.wait_for(std::chrono::seconds(0)))
+		{
+			std::this_thread::yield();
+		}
+
+		latencies_ns.push_back(written_at_ns.load(std::memory_order_acquire) - std::chrono::duration_cast<std::chrono::nanoseconds>(logged_at.time_since_epoch()).count());
+		std::this_thread::sleep_for(std::chrono::microseconds(BENCHMARK_RECORD_INTERVAL_US));
+	}
+	const double load_cpu = load_meter.percent();
+
+	std::sort(latencies_ns.begin(), latencies_ns.end());
+	std::printf("%-16s %9.1f %9.1f %10.1f %10.1f %10.1f %10.1f\n", name, idle_cpu, load_cpu,
+	            percentile(latencies_ns, 0.50) / 1000.0, percentile(latencies_ns, 0.99) / 1000.0,
+	            percentile(latencies_ns, 0.999) / 1000.0, latencies_ns.empty() ? 0.0 : latencies_ns.back() / 1000.0);
+}
+} // anonymous
+
+
+int main()
+{
+	std::printf("%d records, one every %d us, CPU in %% of one core (the logging thread included)\n\n", BENCHMARK_RECORDS, BENCHMARK_RECORD_INTERVAL_US);
+	std::printf("%-16s %9s %9s %10s %10s %10s %10s\n", "strategy", "idle cpu", "load cpu", "p50 us", "p99 us", "p99.9 us", "max us");
+
+	runStrategy("blocking", AsyncLogger::kBlockingWait);
+	runStrategy("spin-then-park", AsyncLogger::kSpinThenPark);
+	runStrategy("yield", AsyncLogger::kYieldLoop);
+	runStrategy("busy-spin", AsyncLogger::kBusySpin);
+
+	return 0;
+}
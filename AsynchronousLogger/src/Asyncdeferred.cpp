@@ -0,0 +1,279 @@
+/** ==========================================================================
+* Filename:Asyncdeferred.cpp  Background formatting of LOGF_DEFER records
+* ********************************************* */
+
+#include "stdafx.h"
+
+#include "Asyncdeferred.h"
+
+#include <cstring>
+#include <cstdio>
+
+namespace {
+const int kMaxConversionSize = 512;
+const size_t kMaxSpecSize = 32;
+const TCHAR* const kMissingArgumentText = _T("<missing argument>");
+const TCHAR* const kBadArgumentText = _T("<bad argument>");
+
+class DeferredArgReader {
+ public:
+   DeferredArgReader(const unsigned char* args, size_t args_size)
+      : current_(args), end_(args + args_size) {}
+
+   bool next(AsyncLogger::internal::DeferredArgType& type) {
+      if (nullptr == current_ || current_ >= end_) {
+         return false;
+      }
+      type = static_cast<AsyncLogger::internal::DeferredArgType>(*current_++);
+      return true;
+   }
+
+   template<typename T>
+   T read() {
+      T value = T();
+      if (current_ + sizeof(T) <= end_) {
+         std::memcpy(&value, current_, sizeof(T));
+         current_ += sizeof(T);
+      }
+      return value;
+   }
+
+   // copies the string into value, which holds DEFERRED_MAX_STRING_LENGTH + 1 characters
+   void readString(TCHAR* value) {
+      unsigned int length = read<unsigned int>();
+      value[0] = 0;
+      if (current_ + length * sizeof(TCHAR) <= end_) {
+         const unsigned int stored = (length < DEFERRED_MAX_STRING_LENGTH) ? length : DEFERRED_MAX_STRING_LENGTH;
+         std::memcpy(value, current_, stored * sizeof(TCHAR));
+         value[stored] = 0;
+         current_ += length * sizeof(TCHAR);
+      }
+   }
+
+ private:
+   const unsigned char* current_;
+   const unsigned char* end_;
+};
+
+// one printf conversion specification, e.g. "%-08.3", built without touching the heap
+class ConversionSpec {
+ public:
+   ConversionSpec() : size_(0) { text_[0] = 0; }
+
+   const TCHAR* c_str() const { return text_; }
+
+   ConversionSpec& operator+=(TCHAR c) {
+      if (size_ + 1 < kMaxSpecSize) { // an absurd width is cut, never overflows
+         text_[size_++] = c;
+         text_[size_] = 0;
+      }
+      return *this;
+   }
+
+   ConversionSpec& operator+=(const TCHAR* text) {
+      while (*text) {
+         *this += *text++;
+      }
+      return *this;
+   }
+
+   void appendNumber(long long value) {
+      TCHAR digits[24];
+      size_t count = 0;
+      unsigned long long magnitude = (value < 0) ? 0 - static_cast<unsigned long long>(value) : static_cast<unsigned long long>(value);
+      do {
+         digits[count++] = static_cast<TCHAR>(_T('0') + magnitude % 10);
+         magnitude /= 10;
+      } while (magnitude);
+      if (value < 0) {
+         *this += _T('-');
+      }
+      while (count) {
+         *this += digits[--count];
+      }
+   }
+
+ private:
+   TCHAR text_[kMaxSpecSize];
+   size_t size_;
+};
+
+bool isFlag(TCHAR c) {
+   return c == _T('-') || c == _T('+') || c == _T(' ') || c == _T('#') || c == _T('0');
+}
+
+bool isDigit(TCHAR c) {
+   return c >= _T('0') && c <= _T('9');
+}
+
+// consumes a width or precision: digits, or '*' which takes the value from the next argument
+bool appendNumberOrStar(const TCHAR*& fmt, ConversionSpec& spec, DeferredArgReader& reader) {
+   using namespace AsyncLogger::internal;
+   if (_T('*') == *fmt) {
+      ++fmt;
+      DeferredArgType type;
+      if (!reader.next(type) || (kDeferredSigned != type && kDeferredUnsigned != type)) {
+         return false;
+      }
+      const long long value = reader.read<long long>();
+      spec.appendNumber(value);
+      return true;
+   }
+   while (isDigit(*fmt)) {
+      spec += *fmt++;
+   }
+   return true;
+}
+
+void skipLengthModifier(const TCHAR*& fmt) {
+   for (;;) {
+      switch (*fmt) {
+      case _T('h'): case _T('l'): case _T('L'): case _T('q'):
+      case _T('j'): case _T('z'): case _T('t'):
+         ++fmt;
+         break;
+      case _T('I'): // MSVC I, I32, I64
+         ++fmt;
+         if ((_T('3') == fmt[0] && _T('2') == fmt[1]) || (_T('6') == fmt[0] && _T('4') == fmt[1])) {
+            fmt += 2;
+         }
+         break;
+      default:
+         return;
+      }
+   }
+}
+
+// spec followed by the length modifier and conversion in suffix
+template<typename T>
+void appendConversion(tstring& out, ConversionSpec spec, const TCHAR* suffix, T value) {
+   TCHAR converted[kMaxConversionSize];
+   spec += suffix;
+   const int written = _sntprintf(converted, kMaxConversionSize, spec.c_str(), value);
+   if (written > 0) {
+      out.append(converted, (written < kMaxConversionSize) ? written : (kMaxConversionSize - 1));
+   }
+}
+} // anonymous
+
+
+namespace AsyncLogger {
+namespace internal {
+
+tstring formatDeferred(const TCHAR* printf_like_message, const unsigned char* args, size_t args_size) {
+   tstring out;
+   appendFormatDeferred(printf_like_message, args, args_size, out);
+   return out;
+}
+
+
+void appendFormatDeferred(const TCHAR* printf_like_message, const unsigned char* args, size_t args_size, tstring& out) {
+   if (nullptr == printf_like_message) {
+      return;
+   }
+
+   DeferredArgReader reader(args, args_size);
+   const TCHAR* fmt = printf_like_message;
+
+   while (*fmt) {
+      if (_T('%') != *fmt) {
+         out += *fmt++;
+         continue;
+      }
+      if (_T('%') == fmt[1]) {
+         out += _T('%');
+         fmt += 2;
+         continue;
+      }
+
+      ConversionSpec spec;
+      spec += *fmt++;
+      while (isFlag(*fmt)) {
+         spec += *fmt++;
+      }
+      bool valid = appendNumberOrStar(fmt, spec, reader);
+      if (_T('.') == *fmt) {
+         spec += *fmt++;
+         valid = appendNumberOrStar(fmt, spec, reader) && valid;
+      }
+      skipLengthModifier(fmt);
+
+      const TCHAR conversion = *fmt;
+      if (0 == conversion) {
+         break;
+      }
+      ++fmt;
+
+      DeferredArgType type;
+      if (!reader.next(type)) {
+         out += kMissingArgumentText;
+         continue;
+      }
+
+      // read the value first so that the buffer stays in sync even for rejected conversions
+      long long signed_value = 0;
+      unsigned long long unsigned_value = 0;
+      double double_value = 0.0;
+      const void* pointer_value = nullptr;
+      TCHAR string_value[DEFERRED_MAX_STRING_LENGTH + 1] = {0};
+      switch (type) {
+      case kDeferredSigned:   signed_value = reader.read<long long>(); unsigned_value = signed_value; double_value = static_cast<double>(signed_value); break;
+      case kDeferredUnsigned: unsigned_value = reader.read<unsigned long long>(); signed_value = unsigned_value; double_value = static_cast<double>(unsigned_value); break;
+      case kDeferredDouble:   double_value = reader.read<double>(); signed_value = static_cast<long long>(double_value); unsigned_value = signed_value; break;
+      case kDeferredPointer:  pointer_value = reader.read<const void*>(); break;
+      case kDeferredLiteral:  pointer_value = reader.read<const TCHAR*>(); break;
+      case kDeferredString:   reader.readString(string_value); break;
+      default:
+         out += kBadArgumentText;
+         return; // unknown tag, the remaining bytes cannot be trusted
+      }
+
+      if (!valid) {
+         out += kBadArgumentText;
+         continue;
+      }
+
+      switch (conversion) {
+      case _T('d'): case _T('i'):
+         appendConversion(out, spec, _T("lld"), signed_value);
+         break;
+      case _T('u'): case _T('o'): case _T('x'): case _T('X'):
+         {
+            const TCHAR suffix[] = {_T('l'), _T('l'), conversion, 0};
+            appendConversion(out, spec, suffix, unsigned_value);
+         }
+         break;
+      case _T('c'):
+         {
+            const TCHAR suffix[] = {conversion, 0};
+            appendConversion(out, spec, suffix, static_cast<int>(signed_value));
+         }
+         break;
+      case _T('f'): case _T('F'): case _T('e'): case _T('E'):
+      case _T('g'): case _T('G'): case _T('a'): case _T('A'):
+         {
+            const TCHAR suffix[] = {conversion, 0};
+            appendConversion(out, spec, suffix, double_value);
+         }
+         break;
+      case _T('p'):
+         appendConversion(out, spec, _T("p"), pointer_value);
+         break;
+      case _T('s'): case _T('S'):
+         if (kDeferredString == type) {
+            appendConversion(out, spec, _T("s"), static_cast<const TCHAR*>(string_value));
+         } else if (kDeferredLiteral == type && pointer_value) {
+            appendConversion(out, spec, _T("s"), static_cast<const TCHAR*>(pointer_value));
+         } else {
+            out += kBadArgumentText;
+         }
+         break;
+      default: // %n and unknown conversions are never executed
+         out += kBadArgumentText;
+         break;
+      }
+   }
+}
+
+} // end namespace internal
+} // end namespace AsyncLogger
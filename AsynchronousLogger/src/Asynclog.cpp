@@ -27,11 +27,16 @@
 #include <chrono>
 #include <signal.h>
 #include <thread>
+#include <vector>
+#include <cwctype>
 
 #include "Asynclogworker.h"
 #include "CrashhandlerAsyncLoggerwin.h"
 
-unsigned int log_level = INFO;
+std::atomic<bool> is_logging_started(false);
+
+// constant-initialized, the call sites of the module point to it before any constructor runs
+AsyncLogger::internal::CallSiteScope async_log_call_site_scope;
 
 tstring _product_name = _T("AsyncLogger");
 tstring _product_version = _T("0.0.1");
@@ -41,23 +46,132 @@ std::once_flag g_initialize_flag;
 AsyncLogWorker* g_logger_instance = nullptr; // instantiated and OWNED somewhere else (main)
 std::mutex g_logging_init_mutex;
 
-AsyncLogger::internal::LogEntry g_first_unintialized_msg = AsyncLogger::internal::LogEntry(_T(""), 0);
+AsyncLogger::internal::LogEntry g_first_unintialized_msg;
 std::once_flag g_set_first_uninitialized_flag;
 std::once_flag g_save_first_unintialized_flag;
 
 const int kMaxMessageSize = 4096;
-const tstring kTruncatedWarningText = _T("[...truncated...]");
 
+// Every LOG statement used so far (registered or resolved) and the levels they are resolved
+// against. Never destroyed: the CallSiteScope destructors of other files run during static
+// destruction, in no particular order with this file's
+struct CallSiteRegistry {
+   CallSiteRegistry() : log_level_(INFO) {}
+
+   std::mutex mutex_; // held by every level change, registration and resolve
+   std::vector<AsyncLogger::internal::LogCallSite*> call_sites_; // updated by every level change
+   std::vector<std::pair<tstring, unsigned int>> module_levels_; // name, level. In the order given
+   std::atomic<unsigned int> log_level_; // runtime level without a module override
+};
+
+CallSiteRegistry& callSiteRegistry() {
+   static CallSiteRegistry* registry = new CallSiteRegistry;
+   return *registry;
+}
+
+/// adds the call site to the registry once. Called with its mutex held
+void listCallSite(CallSiteRegistry& registry, const AsyncLogger::internal::LogCallSite& call_site) {
+   if (!call_site.listed_) {
+      call_site.listed_ = true;
+      // every call site is a non-const static of a LOG macro
+      registry.call_sites_.push_back(const_cast<AsyncLogger::internal::LogCallSite*>(&call_site));
+   }
+}
+
+const TCHAR* const kLevelNames[] = {nullptr, _T("FATAL"), _T("SILENT"), _T("CRITICAL"), _T("WARNING"), _T("INFO"), _T("NORMAL"), _T("DBUG"), _T("LOG_ALL")};
+
+bool equalsIgnoreCase(const tstring& left, const tstring& right) {
+   if (left.size() != right.size()) {
+      return false;
+   }
+
+   for (size_t i = 0; i < left.size(); ++i) {
+      if (std::towupper(left[i]) != std::towupper(right[i])) {
+         return false;
+      }
+   }
+
+   return true;
+}
+
+tstring trimmed(const tstring& text) {
+   const size_t first = text.find_first_not_of(_T(" \t"));
+   if (tstring::npos == first) {
+      return tstring();
+   }
+   return text.substr(first, text.find_last_not_of(_T(" \t")) - first + 1);
+}
+
+/// level by enum name, log_level_strings name or number. \return false if it is none of them
+bool parseLevel(const tstring& text, unsigned int& level) {
+   for (unsigned int candidate = FATAL; candidate <= LOG_ALL; ++candidate) {
+      if (equalsIgnoreCase(text, kLevelNames[candidate]) || equalsIgnoreCase(text, log_level_strings[candidate])) {
+         level = candidate;
+         return true;
+      }
+   }
 
+   if (text.empty() || tstring::npos != text.find_first_not_of(_T("0123456789")) || text.size() > 2) {
+      return false;
+   }
 
+   level = static_cast<unsigned int>(std::stoul(text));
+   return FATAL <= level && level <= LOG_ALL;
+}
+
+/// name is the call site's module, or its file name with or without the extension
+bool matchesModule(const AsyncLogger::internal::LogCallSite& call_site, const tstring& name) {
+   if (call_site.module_ && equalsIgnoreCase(call_site.module_, name)) {
+      return true;
+   }
+
+   tstring file = splitFileName(call_site.file_);
+   if (!file.empty() && _T('"') == file[file.size() - 1]) {
+      file.erase(file.size() - 1); // $File stringizes __FILE__, its quotes included
+   }
+
+   const size_t extension = file.rfind(_T('.'));
+   return equalsIgnoreCase(file, name) || (tstring::npos != extension && equalsIgnoreCase(file.substr(0, extension), name));
+}
+
+/// stores the call site's enabled state for the current levels. Called with the registry mutex held
+bool storeCallSiteState(const CallSiteRegistry& registry, const AsyncLogger::internal::LogCallSite& call_site) {
+   unsigned int level = registry.log_level_.load(std::memory_order_relaxed);
+
+   for (size_t i = 0; i < registry.module_levels_.size(); ++i) {
+      if (matchesModule(call_site, registry.module_levels_[i].first)) {
+         level = registry.module_levels_[i].second;
+         break;
+      }
+   }
+
+   const bool enabled = call_site.level_ <= level;
+   call_site.enabled_state_.store(enabled ? AsyncLogger::internal::kCallSiteEnabled : AsyncLogger::internal::kCallSiteDisabled,
+                                  std::memory_order_relaxed);
+   return enabled;
+}
 
-void saveToLogger(const AsyncLogger::internal::LogEntry& log_entry) {
+/// a level change: every resolved call site gets its new state. Called with the registry mutex held
+void updateResolvedCallSites(const CallSiteRegistry& registry) {
+   for (size_t i = 0; i < registry.call_sites_.size(); ++i) {
+      const AsyncLogger::internal::LogCallSite& call_site = *registry.call_sites_[i];
+
+      if (AsyncLogger::internal::kCallSiteUnresolved != call_site.enabled_state_.load(std::memory_order_relaxed)) {
+         storeCallSiteState(registry, call_site);
+      }
+   }
+}
+
+
+
+
+void saveToLogger(AsyncLogger::internal::LogEntry&& log_entry) {
    // Uninitialized messages are ignored but does not CHECK/crash the logger
    if (!AsyncLogger::internal::isLoggingInitialized()) {
       tstring err(_T("LOGGER NOT INITIALIZED: ") + log_entry.msg_);
       std::call_once(g_set_first_uninitialized_flag,
                      [&] { g_first_unintialized_msg.msg_ += err;
-                           g_first_unintialized_msg.timestamp_ = AsyncLogger::internal::systemtime_now();
+                           g_first_unintialized_msg.tick_ = AsyncLogger::tickNow();
                          });
       // dump to std::err all the non-initialized logs
 	  std::wcerr << err << std::endl;
@@ -66,11 +180,27 @@ void saveToLogger(const AsyncLogger::internal::LogEntry& log_entry) {
    // Save the first uninitialized message, if any
    std::call_once(g_save_first_unintialized_flag, [] {
       if (!g_first_unintialized_msg.msg_.empty()) {
-         g_logger_instance->save(g_first_unintialized_msg);
+         g_logger_instance->save(std::move(g_first_unintialized_msg));
       }
    });
 
-   g_logger_instance->save(log_entry);
+   g_logger_instance->save(std::move(log_entry));
+}
+
+
+// records from LogMessage: the worker serializes them from the LogMessage buffers
+void saveRecordToLogger(const AsyncLogger::internal::LogRecordRef& record) {
+   if (!AsyncLogger::internal::isLoggingInitialized()) {
+      saveToLogger(AsyncLogger::internal::makeLogEntry(record)); // reported, not saved
+      return;
+   }
+   std::call_once(g_save_first_unintialized_flag, [] {
+      if (!g_first_unintialized_msg.msg_.empty()) {
+         g_logger_instance->save(std::move(g_first_unintialized_msg));
+      }
+   });
+
+   g_logger_instance->save(record);
 }
 } // anonymous
 
@@ -90,6 +220,7 @@ void HandleFatalError(int signal)
 void initializeLogging(AsyncLogWorker* bgworker) {
    std::call_once(g_initialize_flag, []() {
       installSignalHandler();
+      calibrateTicks();
    });
 
    std::lock_guard<std::mutex> lock(g_logging_init_mutex);
@@ -133,10 +264,80 @@ bool shutDownLoggingForActiveOnly(AsyncLogWorker* active) {
 }
 
 
+void setLogLevel(unsigned int level) {
+   CallSiteRegistry& registry = callSiteRegistry();
+   std::lock_guard<std::mutex> lock(registry.mutex_);
+   registry.log_level_.store(level, std::memory_order_relaxed);
+   updateResolvedCallSites(registry);
+}
+
+
+unsigned int logLevel() {
+   return callSiteRegistry().log_level_.load(std::memory_order_relaxed);
+}
+
+
+bool setModuleLogLevels(const tstring& module_levels) {
+   std::vector<std::pair<tstring, unsigned int>> parsed;
+   size_t start = 0;
+
+   while (start <= module_levels.size()) {
+      size_t end = module_levels.find_first_of(_T(",;"), start);
+      if (tstring::npos == end) {
+         end = module_levels.size();
+      }
+      const tstring entry = trimmed(module_levels.substr(start, end - start));
+      start = end + 1;
+
+      if (entry.empty()) {
+         continue;
+      }
+
+      const size_t equals = entry.find(_T('='));
+      unsigned int level = 0;
+      if (tstring::npos == equals || !parseLevel(trimmed(entry.substr(equals + 1)), level)) {
+         return false;
+      }
+
+      const tstring name = trimmed(entry.substr(0, equals));
+      if (name.empty()) {
+         return false;
+      }
+
+      parsed.push_back(std::make_pair(name, level));
+   }
+
+   CallSiteRegistry& registry = callSiteRegistry();
+   std::lock_guard<std::mutex> lock(registry.mutex_);
+   registry.module_levels_.swap(parsed);
+   updateResolvedCallSites(registry);
+   return true;
+}
+
+
 
 namespace internal {
 
+const tstring kTruncatedWarningText = _T("[...truncated...]");
+
 /// returns timepoint as std::time_t
+LogEntry makeLogEntry(const LogRecordRef& record) {
+   tstring text;
+   text.reserve(record.textSize());
+   text.append(record.head, record.head_size);
+   text.append(record.prefix, record.prefix_size);
+   text.append(record.body, record.body_size);
+
+   LogEntry entry(std::move(text), record.tick);
+   entry.call_site_ = record.call_site;
+   entry.format_ = record.format;
+   if (record.format && record.args_size) {
+      entry.args_.assign(record.args, record.args + record.args_size);
+   }
+   return entry;
+}
+
+
 std::time_t systemtime_now() {
    const auto now = std::chrono::system_clock::now();
    return std::chrono::system_clock::to_time_t(now);
@@ -148,6 +349,66 @@ bool isLoggingInitialized() {
 }
 
 
+const LogCallSite& registerCallSite(LogCallSite& call_site, const TCHAR* function) {
+   CallSiteRegistry& registry = callSiteRegistry();
+   std::lock_guard<std::mutex> lock(registry.mutex_);
+
+   if (!call_site.isRegistered()) {
+      tstringstream oss;
+
+      if (FATAL == call_site.level_) {
+         oss << _T("Fatal error at: ") << function;
+      }
+
+      oss << _T(" [") << log_level_strings[call_site.level_] << _T("] ") << _T("[") << splitFileName(call_site.file_);
+      oss << _T(" L: ") << call_site.line_ << _T("]\t");
+
+      call_site.function_ = function;
+      listCallSite(registry, call_site);
+      call_site.prefix_.store(new tstring(oss.str()), std::memory_order_release); // freed by the CallSiteScope
+   }
+
+   return call_site;
+}
+
+
+CallSiteScope::~CallSiteScope() {
+   CallSiteRegistry& registry = callSiteRegistry();
+   std::lock_guard<std::mutex> lock(registry.mutex_);
+   // queued records point to their call site's prefix: only free it once nothing is logged anymore
+   const bool free_prefixes = !isLoggingInitialized();
+   size_t kept = 0;
+
+   for (size_t i = 0; i < registry.call_sites_.size(); ++i) {
+      LogCallSite* call_site = registry.call_sites_[i];
+
+      if (this != call_site->scope_) {
+         registry.call_sites_[kept++] = call_site;
+         continue;
+      }
+
+      // unresolved and unlisted: a later use (another file's static destructor) starts over
+      call_site->listed_ = false;
+      call_site->enabled_state_.store(kCallSiteUnresolved, std::memory_order_relaxed);
+      if (free_prefixes) {
+         delete call_site->prefix_.exchange(nullptr, std::memory_order_acq_rel);
+      }
+   }
+
+   registry.call_sites_.resize(kept);
+}
+
+
+bool resolveCallSiteEnabled(const LogCallSite& call_site) {
+   CallSiteRegistry& registry = callSiteRegistry();
+   std::lock_guard<std::mutex> lock(registry.mutex_);
+
+   // under the lock: a concurrent level change either comes first or finds the call site listed
+   listCallSite(registry, call_site);
+   return storeCallSiteState(registry, call_site);
+}
+
+
 /** Fatal call saved to logger. This will trigger SIGABRT or other fatal signal
   * to exit the program. After saving the fatal message the calling thread
   * will sleep forever (i.e. until the background thread catches up, saves the fatal
@@ -163,7 +424,7 @@ void fatalCallToLogger(FatalMessage message) {
 
       internal::exitWithDefaultSignalHandler(message.signal_id_);
    }
-   g_logger_instance->fatal(message);
+   g_logger_instance->fatal(std::move(message));
    while (internal::isLoggingInitialized()) {
       std::this_thread::sleep_for(std::chrono::seconds(1));
    }
@@ -181,29 +442,56 @@ void changeFatalInitHandlerForUnitTesting(std::function<void(FatalMessage) > fat
 
 
 
-LogContractMessage::LogContractMessage(const tstring& file, const int line,
-                                       const tstring& function, const tstring& boolean_expression)
-   : LogMessage(file, line, function, FATAL)
+LogContractMessage::LogContractMessage(const LogCallSite& call_site, const tstring& boolean_expression)
+   : LogMessage(call_site)
    , expression_(boolean_expression)
 {}
 
 LogContractMessage::~LogContractMessage() {
    tstringstream oss;
    if (0 == expression_.compare(k_fatal_log_expression)) {
-      oss << _T("\n[  *******\tEXIT trigger caused by File :: ")<< file_ << _T(" Line: ") << line_ << _T(" Function:") << function_ << _T(" LOG(FATAL): \n\t");
+      oss << _T("\n[  *******\tEXIT trigger caused by File :: ")<< call_site_.file_ << _T(" Line: ") << call_site_.line_ << _T(" Function:") << call_site_.function_ << _T(" LOG(FATAL): \n\t");
    } else {
       oss << _T("\n[  *******\tEXIT trigger caused by broken Contract: CHECK(" << expression_ << ")\n\t");
    }
    log_entry_ = oss.str();
 }
 
-LogMessage::LogMessage(const tstring& file, const int line, const tstring& function, const unsigned int level)
-	: file_(file)
-   , line_(line)
-   , function_(function)
-   , level_(level)
-   , timestamp_(systemtime_now())
-{}
+LogMessage::LogMessage(const LogCallSite& call_site)
+	: call_site_(call_site)
+   , level_(call_site.level_)
+   , enabled_(callSiteEnabled(call_site))
+   , message_stream_(acquireThreadMessageStream())
+   , tick_(AsyncLogger::tickNow())
+   , deferred_format_(nullptr)
+{
+	if (nullptr == message_stream_)
+	{
+		// LOG used while building another message on this thread, e.g. from an operator<<
+		own_message_stream_.reset(new MessageStream);
+		message_stream_ = own_message_stream_.get();
+	}
+}
+
+
+MessageStream* acquireThreadMessageStream() {
+   static thread_local MessageStream t_message_stream;
+
+   if (t_message_stream.in_use_) {
+      return nullptr;
+   }
+
+   t_message_stream.in_use_ = true;
+   t_message_stream.reset();
+   return &t_message_stream;
+}
+
+
+void releaseThreadMessageStream(MessageStream* message_stream) {
+   if (message_stream) {
+      message_stream->in_use_ = false;
+   }
+}
 
 
 void LogMessage::WriteLogToStream()
@@ -212,27 +500,51 @@ void LogMessage::WriteLogToStream()
 	
 	try
 	{
-		if (level_ <= log_level)
+		if (enabled_)
 		{
-			const tstring str(stream_.str());
-
-			if (!str.empty())
+			if (fatal && deferred_format_)
 			{
-				tstringstream oss;
-
-				if (fatal)
-				{
-					oss << _T("Fatal error at: ") << function_;
-				}
-
-				oss << _T(" [") << log_level_strings[level_] << _T("] ") << _T("[") << splitFileName(file_);
-				oss << _T(" L: ") << line_ << _T("]\t");
-
-				log_entry_ += oss.str();
+				// no background formatting for FATAL, the message is also dumped to std::wcerr below
+				messageStream() << formatDeferred(deferred_format_, deferred_args_);
+				deferred_format_ = nullptr;
+			}
 
-				log_entry_ += str;
+			const size_t body_size = message_stream_->size();
 
-				saveToLogger(LogEntry(log_entry_, timestamp_)); // message saved
+			if (fatal && body_size)
+			{
+				const tstring& prefix = call_site_.prefix();
+
+				tstring text;
+				text.reserve(log_entry_.size() + prefix.size() + body_size);
+				text += log_entry_;
+				text += prefix;
+				text.append(message_stream_->data(), body_size);
+				log_entry_ = text; // also dumped to std::wcerr below
+
+				LogEntry entry(std::move(text), tick_);
+				entry.call_site_ = &call_site_;
+				saveToLogger(std::move(entry)); // message saved
+			}
+			else if (!fatal && (body_size || deferred_format_))
+			{
+				const tstring& prefix = call_site_.prefix();
+
+				// handed over in place, the worker copies it once into its transport
+				LogRecordRef record = LogRecordRef();
+				record.tick = tick_;
+				record.call_site = &call_site_;
+				record.head = log_entry_.data();
+				record.head_size = log_entry_.size();
+				record.prefix = prefix.data();
+				record.prefix_size = prefix.size();
+				record.body = message_stream_->data();
+				record.body_size = body_size;
+				record.format = deferred_format_;
+				record.args = deferred_format_ ? deferred_args_.data() : nullptr;
+				record.args_size = deferred_format_ ? deferred_args_.size() : 0;
+
+				saveRecordToLogger(record); // message saved
 			}
 		}
 
@@ -240,8 +552,8 @@ void LogMessage::WriteLogToStream()
 		{     // os_fatal is handled by crashhandlers
 			  // local scope - to trigger FatalMessage sending
 			FatalMessage::FatalType fatal_type(FatalMessage::kReasonFatal);
-			FatalMessage fatal_message(LogEntry(log_entry_, timestamp_), fatal_type, SIGABRT);
-			FatalTrigger trigger(fatal_message);
+			FatalMessage fatal_message(LogEntry(log_entry_, tick_), fatal_type, SIGABRT);
+			FatalTrigger trigger(std::move(fatal_message));
 			std::wcerr << log_entry_ << _T("\t*******  ]") << std::endl << std::flush;
 			// will send to worker
 		}
@@ -257,18 +569,29 @@ LogMessage::~LogMessage() {
 	using namespace internal;
 
 	WriteLogToStream();
+
+	if (!own_message_stream_)
+	{
+		releaseThreadMessageStream(message_stream_);
+	}
 }
 
 
 // represents the actual fatal message
 FatalMessage::FatalMessage(LogEntry message, FatalType type, unsigned long signal_id)
-   : message_(message)
+   : message_(std::move(message))
    , type_(type)
    , signal_id_(signal_id) {}
 
 
-FatalMessage& FatalMessage::operator=(const FatalMessage& other) {
-   message_ = other.message_;
+FatalMessage::FatalMessage(FatalMessage&& other)
+   : message_(std::move(other.message_))
+   , type_(other.type_)
+   , signal_id_(other.signal_id_) {}
+
+
+FatalMessage& FatalMessage::operator=(FatalMessage&& other) {
+   message_ = std::move(other.message_);
    type_ = other.type_;
    signal_id_ = other.signal_id_;
    return *this;
@@ -276,13 +599,13 @@ FatalMessage& FatalMessage::operator=(const FatalMessage& other) {
 
 
 // used to RAII trigger fatal message sending to AsyncLogWorker
-FatalTrigger::FatalTrigger(const FatalMessage& message)
-   :  message_(message) {}
+FatalTrigger::FatalTrigger(FatalMessage&& message)
+   :  message_(std::move(message)) {}
 
 // at destruction, flushes fatal message to AsyncLogWorker
 FatalTrigger::~FatalTrigger() {
    // either we will stay here eternally, or it's in unit-test mode
-   g_fatal_to_Asynclogworker_function_ptr(message_);
+   g_fatal_to_Asynclogworker_function_ptr(std::move(message_));
 
 }
 
@@ -294,12 +617,12 @@ void LogMessage::messageSave( const TCHAR* printf_like_message, ...)
 		
 
 #ifndef STATIC_LOG_LEVEL
-		if (level_ <= log_level)
+		if (enabled_)
 		{
 #endif
 			__try
 			{
-				if (stream_ && printf_like_message)
+				if (messageStream() && printf_like_message)
 				{
 					TCHAR finished_message[kMaxMessageSize];
 					va_list arglist;
@@ -312,16 +635,16 @@ void LogMessage::messageSave( const TCHAR* printf_like_message, ...)
 
 						if (nbrcharacters <= 0) 
 						{
-							stream_ << _T("\n\tERROR LOG MSG NOTIFICATION: Failure to parse the message successfully");
-							stream_ << _T('"') << printf_like_message << _T('"') << std::endl;
+							messageStream() << _T("\n\tERROR LOG MSG NOTIFICATION: Failure to parse the message successfully");
+							messageStream() << _T('"') << printf_like_message << _T('"') << std::endl;
 						}	
 						else if (nbrcharacters > kMaxMessageSize) 
 						{
-							stream_  << finished_message << kTruncatedWarningText;
+							messageStream()  << finished_message << kTruncatedWarningText;
 						}	
 						else 
 						{
-							stream_ << finished_message;
+							messageStream() << finished_message;
 						}
 					}
 				}
@@ -344,7 +667,7 @@ void LogMessage::messageSave( const char* printf_like_message, ...) {
 	{
 
 #ifndef STATIC_LOG_LEVEL
-		if (level_ <= log_level)
+		if (enabled_)
 		{
 #endif
 			__try
@@ -362,14 +685,14 @@ void LogMessage::messageSave( const char* printf_like_message, ...) {
 					va_end(arglist);
 
 					if (nbrcharacters <= 0) {
-						stream_ << _T("\n\tERROR LOG MSG NOTIFICATION: Failure to parse successfully the message");
-						stream_ << _T('"') << printf_like_message << _T('"') << std::endl;
+						messageStream() << _T("\n\tERROR LOG MSG NOTIFICATION: Failure to parse successfully the message");
+						messageStream() << _T('"') << printf_like_message << _T('"') << std::endl;
 					}
 					else if (nbrcharacters > kMaxMessageSize) {
-						stream_ << finished_message << kTruncatedWarningText;
+						messageStream() << finished_message << kTruncatedWarningText;
 					}
 					else {
-						stream_ << finished_message;
+						messageStream() << finished_message;
 					}
 				}
 			}
@@ -0,0 +1,380 @@
+/** ==========================================================================
+* Filename:Asynclogsink.cpp  File backends behind the background worker
+* ********************************************* */
+
+#include "stdafx.h"
+
+#include "Asynclogsink.h"
+
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <vector>
+#include <locale>
+#include <codecvt>
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__)
+#include <io.h>
+#include <share.h>
+#else
+#include <climits>
+#include <unistd.h>
+#include <sys/uio.h>
+#endif
+
+namespace {
+
+bool openLogFile(const tstring& complete_file_with_path, std::wofstream& outstream) {
+   std::ios_base::openmode mode = std::ios_base::out | std::ios_base::ate | std::ios::in | std::ios_base::binary; // for clarity: it's really overkill since it's an tfstream
+
+   //mode |= std::ios_base::trunc;
+   outstream.open(complete_file_with_path, mode);
+   if (!outstream.is_open()) {
+
+      outstream.close();
+
+      outstream.open(complete_file_with_path,std::fstream::binary | std::fstream::trunc | std::fstream::out);
+      outstream.close();
+      // re-open with original flags
+      outstream.open(complete_file_with_path, mode);
+
+      if (!outstream.is_open())
+      {
+         tstringstream ss_error;
+         ss_error << "FILE ERROR:  could not open log file:[" << complete_file_with_path << "]";
+         ss_error << "\n\t\t std::ios_base state = " << outstream.rdstate();
+         std::cerr << ss_error.str().c_str() << std::endl << std::flush;
+         return false;
+      }
+   }
+
+   return true;
+}
+
+
+/// The original backend: std::wofstream writing UTF-8 through a codecvt facet
+class StreamFileSink : public AsyncLogger::LogFileSink {
+ public:
+   StreamFileSink() {}
+
+   virtual bool open(const tstring& file_with_full_path) {
+      out_.reset(new std::wofstream);
+      if (!openLogFile(file_with_full_path, *out_)) {
+         out_.reset();
+         return false;
+      }
+
+      const std::locale utf8_locale = std::locale(std::locale(), new std::codecvt_utf8<wchar_t>());
+      out_->imbue(utf8_locale);
+      out_->fill(_T('0'));
+      return true;
+   }
+
+   virtual bool isOpen() const {
+      return out_ && out_->is_open();
+   }
+
+   virtual void close() {
+      if (isOpen()) {
+         out_->flush();
+         out_->close();
+      }
+   }
+
+   virtual void write(const TCHAR* text, size_t length) {
+      if (out_ && *out_) {
+         out_->seekp(0, std::ios_base::end);
+         out_->write(text, length);
+      }
+   }
+
+   virtual AsyncLogger::LogFileFlushResult flush() {
+      if (out_) {
+         *out_ << std::flush;
+         if (!*out_) {
+            return AsyncLogger::kFlushDropped; // a failed stream discards what it was given
+         }
+      }
+      return AsyncLogger::kFlushWritten;
+   }
+
+   virtual unsigned long long size() const {
+      if (!out_) {
+         return 0;
+      }
+      const std::streamoff position = out_->tellp();
+      return (position > 0) ? static_cast<unsigned long long>(position) : 0;
+   }
+
+ private:
+   std::unique_ptr<std::wofstream> out_;
+
+   StreamFileSink(const StreamFileSink&); // c++11 feature not yet in vs2010 = delete;
+   StreamFileSink& operator=(const StreamFileSink&); // c++11 feature not yet in vs2010 = delete;
+};
+
+
+// TCHAR text to UTF-8. wchar_t is UTF-16 on Windows and UTF-32 on POSIX, surrogate
+// pairs are combined either way
+void appendUtf8(std::string& out, const TCHAR* text, size_t length) {
+#ifdef _UNICODE
+   for (size_t i = 0; i < length; ++i) {
+      unsigned long code_point = static_cast<unsigned long>(text[i]);
+
+      if (code_point < 0x80) {
+         out += static_cast<char>(code_point);
+         continue;
+      }
+
+      if (code_point >= 0xD800 && code_point <= 0xDBFF && i + 1 < length) {
+         const unsigned long low = static_cast<unsigned long>(text[i + 1]);
+         if (low >= 0xDC00 && low <= 0xDFFF) {
+            code_point = 0x10000 + ((code_point - 0xD800) << 10) + (low - 0xDC00);
+            ++i;
+         }
+      }
+
+      if ((code_point >= 0xD800 && code_point <= 0xDFFF) || code_point > 0x10FFFF) {
+         code_point = 0xFFFD; // lone surrogate or out of range
+      }
+
+      if (code_point < 0x800) {
+         out += static_cast<char>(0xC0 | (code_point >> 6));
+         out += static_cast<char>(0x80 | (code_point & 0x3F));
+      } else if (code_point < 0x10000) {
+         out += static_cast<char>(0xE0 | (code_point >> 12));
+         out += static_cast<char>(0x80 | ((code_point >> 6) & 0x3F));
+         out += static_cast<char>(0x80 | (code_point & 0x3F));
+      } else {
+         out += static_cast<char>(0xF0 | (code_point >> 18));
+         out += static_cast<char>(0x80 | ((code_point >> 12) & 0x3F));
+         out += static_cast<char>(0x80 | ((code_point >> 6) & 0x3F));
+         out += static_cast<char>(0x80 | (code_point & 0x3F));
+      }
+   }
+#else
+   out.append(text, length);
+#endif
+}
+
+
+std::string errorText(int error) {
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__)
+   char text[128];
+   return (0 == strerror_s(text, sizeof(text), error)) ? std::string(text) : std::string("unknown error");
+#else
+   return std::strerror(error);
+#endif
+}
+
+
+/// Raw file descriptor backend. Every write() encodes its batch once into its own
+/// chunk; flush() hands all chunks to the operating system, with writev() on POSIX
+/// and the CRT's unbuffered _write() on Windows. The file size is kept in a counter
+/// so rotation never has to ask the file for its position
+class PosixFileSink : public AsyncLogger::LogFileSink {
+ public:
+   PosixFileSink() : fd_(-1), used_chunks_(0), pending_bytes_(0), file_size_(0) {}
+   virtual ~PosixFileSink() { close(); }
+
+   virtual bool open(const tstring& file_with_full_path) {
+      close();
+
+      std::string path;
+      appendUtf8(path, file_with_full_path.c_str(), file_with_full_path.size());
+
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__)
+      const int error = _tsopen_s(&fd_, file_with_full_path.c_str(), _O_WRONLY | _O_CREAT | _O_APPEND | _O_BINARY | _O_NOINHERIT,
+                                  _SH_DENYNO, _S_IREAD | _S_IWRITE);
+      if (0 != error) {
+         fd_ = -1;
+         std::cerr << "FILE ERROR:  could not open log file:[" << path << "] " << errorText(error) << std::endl << std::flush;
+         return false;
+      }
+
+      const __int64 length = _filelengthi64(fd_);
+      file_size_ = (length > 0) ? static_cast<unsigned long long>(length) : 0;
+#else
+      do {
+         fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+      } while (fd_ < 0 && EINTR == errno);
+
+      if (fd_ < 0) {
+         std::cerr << "FILE ERROR:  could not open log file:[" << path << "] " << errorText(errno) << std::endl << std::flush;
+         return false;
+      }
+
+      struct stat file_status;
+      file_size_ = (0 == ::fstat(fd_, &file_status)) ? static_cast<unsigned long long>(file_status.st_size) : 0;
+#endif
+      return true;
+   }
+
+   virtual bool isOpen() const {
+      return fd_ >= 0;
+   }
+
+   virtual void close() {
+      if (fd_ >= 0) {
+         if (AsyncLogger::kFlushHeldBack == flush()) {
+            std::cerr << "FILE ERROR:  " << pending_bytes_ << " bytes of log text could not be written before closing the log file, they are dropped" << std::endl << std::flush;
+            used_chunks_ = 0;
+            pending_bytes_ = 0;
+         }
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__)
+         _commit(fd_); // _write() leaves the text in the system cache, get it to the disk once at the end
+         _close(fd_);
+#else
+         ::close(fd_);
+#endif
+         fd_ = -1;
+      }
+   }
+
+   virtual void write(const TCHAR* text, size_t length) {
+      if (fd_ < 0 || 0 == length) {
+         return;
+      }
+
+      if (used_chunks_ == chunks_.size()) {
+         chunks_.push_back(std::string());
+      }
+
+      std::string& chunk = chunks_[used_chunks_++];
+      chunk.clear();
+      appendUtf8(chunk, text, length);
+      pending_bytes_ += chunk.size();
+   }
+
+   virtual AsyncLogger::LogFileFlushResult flush() {
+      if (fd_ < 0 || 0 == used_chunks_) {
+         return AsyncLogger::kFlushWritten;
+      }
+
+      size_t chunk = 0;
+      size_t offset = 0; // already written bytes of chunks_[chunk]
+
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__)
+      while (chunk < used_chunks_) {
+         const size_t remaining = chunks_[chunk].size() - offset;
+         const unsigned int request = (remaining < kMaxWriteSize) ? static_cast<unsigned int>(remaining) : kMaxWriteSize;
+         const int written = _write(fd_, chunks_[chunk].data() + offset, request);
+         if (written <= 0) {
+            std::cerr << "FILE ERROR:  writing the log file failed: " << errorText(errno) << std::endl << std::flush;
+            break;
+         }
+
+         file_size_ += static_cast<unsigned long long>(written);
+         offset += static_cast<size_t>(written);
+         if (offset == chunks_[chunk].size()) {
+            offset = 0;
+            ++chunk;
+         }
+      }
+#else
+      while (chunk < used_chunks_) {
+         iovec vectors[kMaxIoVectors];
+         int count = 0;
+
+         for (size_t i = chunk; i < used_chunks_ && count < kMaxIoVectors; ++i, ++count) {
+            const size_t skip = (i == chunk) ? offset : 0;
+            vectors[count].iov_base = const_cast<char*>(chunks_[i].data() + skip);
+            vectors[count].iov_len = chunks_[i].size() - skip;
+         }
+
+         const ssize_t written = ::writev(fd_, vectors, count);
+         if (written < 0) {
+            if (EINTR == errno) {
+               continue;
+            }
+            std::cerr << "FILE ERROR:  writing the log file failed: " << errorText(errno) << std::endl << std::flush;
+            break;
+         }
+
+         file_size_ += static_cast<unsigned long long>(written);
+
+         // partial writes are possible, step over what the kernel took
+         size_t remaining = static_cast<size_t>(written);
+         while (chunk < used_chunks_ && remaining >= chunks_[chunk].size() - offset) {
+            remaining -= chunks_[chunk].size() - offset;
+            offset = 0;
+            ++chunk;
+         }
+         offset += remaining;
+      }
+#endif
+
+      return keepUnwritten(chunk, offset);
+   }
+
+   virtual unsigned long long size() const {
+      return file_size_ + pending_bytes_;
+   }
+
+ private:
+   // After a failed write the text not written yet, from chunks_[chunk] at offset, is moved to the
+   // front and tried again by the next flush(). Past kMaxUnwrittenBytes it is given up on
+   AsyncLogger::LogFileFlushResult keepUnwritten(size_t chunk, size_t offset) {
+      if (chunk == used_chunks_) {
+         used_chunks_ = 0;
+         pending_bytes_ = 0;
+         return AsyncLogger::kFlushWritten;
+      }
+
+      chunks_[chunk].erase(0, offset);
+      unsigned long long unwritten = 0;
+      for (size_t i = chunk; i < used_chunks_; ++i) {
+         unwritten += chunks_[i].size();
+         chunks_[i - chunk].swap(chunks_[i]);
+      }
+      used_chunks_ -= chunk;
+      pending_bytes_ = unwritten;
+
+      if (unwritten > kMaxUnwrittenBytes) {
+         std::cerr << "FILE ERROR:  " << unwritten << " bytes of log text could not be written, they are dropped" << std::endl << std::flush;
+         used_chunks_ = 0;
+         pending_bytes_ = 0;
+         return AsyncLogger::kFlushDropped;
+      }
+
+      return AsyncLogger::kFlushHeldBack;
+   }
+
+   static const unsigned long long kMaxUnwrittenBytes = 8 * 1024 * 1024;
+
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__)
+   static const unsigned int kMaxWriteSize = 1u << 30; // _write() takes an unsigned int count
+#elif defined(IOV_MAX)
+   static const int kMaxIoVectors = (IOV_MAX < 1024) ? IOV_MAX : 1024;
+#else
+   static const int kMaxIoVectors = 16;
+#endif
+
+   int fd_;
+   std::vector<std::string> chunks_; // encoded batches, kept allocated between flushes
+   size_t used_chunks_;
+   unsigned long long pending_bytes_;
+   unsigned long long file_size_;
+
+   PosixFileSink(const PosixFileSink&); // c++11 feature not yet in vs2010 = delete;
+   PosixFileSink& operator=(const PosixFileSink&); // c++11 feature not yet in vs2010 = delete;
+};
+
+} // anonymous
+
+
+namespace AsyncLogger {
+
+std::unique_ptr<LogFileSink> createLogFileSink(LogFileSinkType type) {
+   if (kPosixFileSink == type) {
+      return std::unique_ptr<LogFileSink>(new PosixFileSink);
+   }
+   return std::unique_ptr<LogFileSink>(new StreamFileSink);
+}
+
+} // end namespace AsyncLogger
@@ -26,6 +26,11 @@
 #include "CrashhandlerAsyncLoggerwin.h"
 #include "Asynctime.h"
 #include "Asyncfuture.h"
+#include "Asynclogsink.h"
+#include "spsc_byte_ring.h"
+#include "mpsc_byte_ring.h"
+#include <mutex>
+#include <vector>
 #include <locale>
 #include <codecvt>
 #include "SmartMutex.h"
@@ -35,6 +40,8 @@ using namespace std;
 #include "ICriticalSection.h"
 
 #define MAX_LOG_FILE_ROTATE_RETRIES 5
+#define LOG_RECORD_BATCH_SIZE 256
+#define LOG_FORMAT_JOBS_PER_THREAD 2 // batches in flight per formatter thread
 
 using namespace std;
 using namespace AsyncLogger;
@@ -46,6 +53,210 @@ static const tstring time_formatted = _T("%H:%M:%S");
 static const tstring file_name_time_formatted =  _T("%Y%m%d-%H%M%S");
 static const DWORD	 currentProcessPid		= ::GetCurrentProcessId ();
 
+// the logger's own entries have no call site, they are treated as most severe
+unsigned int recordLevel(const LogCallSite* call_site) {
+	return call_site ? call_site->level_ : static_cast<unsigned int>(FATAL);
+}
+
+unsigned int recordLevel(const LogEntry& message) {
+	return recordLevel(message.call_site_);
+}
+
+// kDropOldest needs a queue the producers can pop from: the byte rings are read in place
+// by the background thread, with kDropOldest the records take the record queue instead
+RecordTransport recordTransport(const AsyncLogWorkerOptions& options) {
+	return (kDropOldest == options.queue_full_policy) ? kRecordQueue : options.record_transport;
+}
+
+// a record too large for a ring block of max_size bytes, cut down to fit and marked with
+// kTruncatedWarningText. It is built in text, deferred arguments are rendered into it first
+LogRecordRef truncatedRecord(const LogRecordRef& record, size_t max_size, tstring& text) {
+	text.assign(record.head, record.head_size);
+	text.append(record.prefix, record.prefix_size);
+	text.append(record.body, record.body_size);
+	if (record.format)
+	{
+		AsyncLogger::internal::appendFormatDeferred(record.format, record.args, record.args_size, text);
+	}
+
+	const size_t max_chars = ((max_size & ~static_cast<size_t>(RECORD_ALIGNMENT - 1)) - sizeof(RecordHeader)) / sizeof(TCHAR);
+	if (text.size() > max_chars)
+	{
+		text.resize(max_chars - AsyncLogger::internal::kTruncatedWarningText.size());
+		text += AsyncLogger::internal::kTruncatedWarningText;
+	}
+
+	LogRecordRef truncated = LogRecordRef();
+	truncated.tick = record.tick;
+	truncated.call_site = record.call_site;
+	truncated.body = text.data();
+	truncated.body_size = text.size();
+	return truncated;
+}
+
+// a queued entry described as a LogRecordRef, to serialize it into a byte ring
+LogRecordRef recordRef(const LogEntry& message) {
+	LogRecordRef record = LogRecordRef();
+	record.tick = message.tick_;
+	record.call_site = message.call_site_;
+	record.body = message.msg_.data();
+	record.body_size = message.msg_.size();
+	record.format = message.format_;
+	record.args = message.args_.empty() ? nullptr : &message.args_[0];
+	record.args_size = message.args_.size();
+	return record;
+}
+
+
+// kPerThreadRings: one logging thread's ring, shared by the thread and the worker's registry
+struct ThreadRecordRing {
+	explicit ThreadRecordRing(size_t capacity) : ring_(capacity), closed_(false) {}
+
+	spsc_byte_ring ring_;
+	std::atomic<bool> closed_; // the thread exited (or moved to another worker), reclaim once drained
+};
+
+// the calling thread's ring and the worker it is registered with
+struct ThreadRingSlot {
+	ThreadRingSlot() : worker_id_(0) {}
+	~ThreadRingSlot() { close(); }
+
+	void close() {
+		if (ring_)
+		{
+			ring_->closed_.store(true, std::memory_order_release);
+			ring_.reset();
+		}
+	}
+
+	unsigned long long worker_id_;
+	std::shared_ptr<ThreadRecordRing> ring_;
+};
+
+// AsyncLogHistogram filled by one thread, the background thread, and read by any
+class StatsHistogram {
+public:
+	StatsHistogram() : count_(0), total_ns_(0), max_ns_(0)
+	{
+		for (size_t i = 0; i < LOG_STATS_HISTOGRAM_BUCKETS; ++i)
+		{
+			buckets_[i].store(0, std::memory_order_relaxed);
+		}
+	}
+
+	// single writer: plain loads and stores, no read-modify-write
+	void add(long long ns)
+	{
+		const unsigned long long value = (ns > 0) ? static_cast<unsigned long long>(ns) : 0;
+		size_t bucket = 0;
+		while (bucket < LOG_STATS_HISTOGRAM_BUCKETS - 1 && (value >> bucket))
+		{
+			++bucket;
+		}
+
+		buckets_[bucket].store(buckets_[bucket].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		count_.store(count_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		total_ns_.store(total_ns_.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+		if (value > max_ns_.load(std::memory_order_relaxed))
+		{
+			max_ns_.store(value, std::memory_order_relaxed);
+		}
+	}
+
+	void snapshot(AsyncLogHistogram& out) const
+	{
+		out.count = count_.load(std::memory_order_relaxed);
+		out.total_ns = total_ns_.load(std::memory_order_relaxed);
+		out.max_ns = max_ns_.load(std::memory_order_relaxed);
+		for (size_t i = 0; i < LOG_STATS_HISTOGRAM_BUCKETS; ++i)
+		{
+			out.buckets[i] = buckets_[i].load(std::memory_order_relaxed);
+		}
+	}
+
+private:
+	std::atomic<unsigned long long> count_;
+	std::atomic<unsigned long long> total_ns_;
+	std::atomic<unsigned long long> max_ns_;
+	std::atomic<unsigned long long> buckets_[LOG_STATS_HISTOGRAM_BUCKETS];
+};
+
+long long nanosecondsSince(const steady_time_point& start) {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+// keeps the highest value stored in high_water, single writer
+void storeWithHighWater(std::atomic<size_t>& current, std::atomic<size_t>& high_water, size_t value) {
+	current.store(value, std::memory_order_relaxed);
+	if (value > high_water.load(std::memory_order_relaxed))
+	{
+		high_water.store(value, std::memory_order_relaxed);
+	}
+}
+
+
+// format_threads > 0: one batch of records on its way through a formatter thread.
+// Batches are written in the order they were collected, then their ring space is released
+struct FormatJob {
+	FormatJob() : shared_ring_position_(0), most_severe_level_(LOG_ALL), format_ns_(0)
+	{
+		std::fill(levels_, levels_ + LOG_ALL + 1, 0ULL);
+	}
+
+	size_t size() const { return entries_.size() + records_.size(); }
+
+	std::vector<LogEntry> entries_;            // popped from records_
+	std::vector<const RecordHeader*> records_; // read in place from the byte rings, formatted after entries_
+	size_t shared_ring_position_;              // shared ring space before it is released once written
+	std::vector<std::pair<std::shared_ptr<ThreadRecordRing>, size_t> > ring_positions_; // same for the thread rings
+	unsigned int most_severe_level_;
+	unsigned long long levels_[LOG_ALL + 1]; // records by level, see AsyncLogWorkerImpl::collected_
+	tstring text_;
+	long long format_ns_; // measured by the formatter thread
+	std::future<size_t> formatted_;
+};
+
+// a formatter thread and the timestamp cache only it uses
+struct RecordFormatter {
+	std::unique_ptr<AsyncLogger::Active> thread_;
+	AsyncLogger::TimestampCache timestamp_cache_;
+};
+
+thread_local ThreadRingSlot t_ring_slot;
+std::atomic<unsigned long long> g_next_worker_id(1);
+
+// adds the per level record counts of from to to, from is cleared
+void moveLevelCounts(unsigned long long* from, unsigned long long* to) {
+	for (unsigned int level = 0; level <= LOG_ALL; ++level)
+	{
+		to[level] += from[level];
+		from[level] = 0;
+	}
+}
+
+// ".uuuuuu", the fraction of the second after the cached "YYYY/MM/DD hh:mm:ss"
+void appendMicroseconds(unsigned microseconds, tstring& buffer) {
+	TCHAR digits[7] = {_T('.')};
+	for (int i = 6; i > 0; --i)
+	{
+		digits[i] = static_cast<TCHAR>(_T('0') + microseconds % 10);
+		microseconds /= 10;
+	}
+	buffer.append(digits, 7);
+}
+
+// decimal digits of value, std::to_wstring without the temporary string
+void appendDecimal(unsigned long long value, tstring& buffer) {
+	TCHAR digits[20];
+	size_t count = 0;
+	do
+	{
+		digits[sizeof(digits) / sizeof(digits[0]) - ++count] = static_cast<TCHAR>(_T('0') + value % 10);
+		value /= 10;
+	} while (value);
+	buffer.append(digits + sizeof(digits) / sizeof(digits[0]) - count, count);
+}
+
 // check for filename validity -  filename should not be part of PATH
 bool isValidFilename(const tstring prefix_filename) {
 
@@ -196,67 +407,132 @@ int createLogFileName(const tstring& verified_prefix, tstring &outFile, unsigned
 }
 
 
-bool openLogFile(const tstring& complete_file_with_path, std::wofstream& outstream) {
-   std::ios_base::openmode mode = std::ios_base::out | std::ios_base::ate | std::ios::in | std::ios_base::binary; // for clarity: it's really overkill since it's an tfstream
-
-   //mode |= std::ios_base::trunc;
-   outstream.open(complete_file_with_path, mode);
-	if (!outstream.is_open()) {
-
-		outstream.close();
-
-		outstream.open(complete_file_with_path,std::fstream::binary | std::fstream::trunc | std::fstream::out);    
-		outstream.close();
-		// re-open with original flags
-		outstream.open(complete_file_with_path, mode);
-
-		if (!outstream.is_open())
-		{
-			tstringstream ss_error;
-			ss_error << "FILE ERROR:  could not open log file:[" << complete_file_with_path << "]";
-			ss_error << "\n\t\t std::ios_base state = " << outstream.rdstate();
-			std::cerr << ss_error.str().c_str() << std::endl << std::flush;
-			return false;
-		}
-   }  
-
-   return true;
-}
-
-
-std::unique_ptr<std::wofstream> createLogFile(const tstring& file_with_full_path) {
-   std::unique_ptr<std::wofstream> out(new std::wofstream);
-   std::wofstream& stream(*(out.get()));
-   bool success_with_open_file = openLogFile(file_with_full_path, stream);
-   if (false == success_with_open_file) {
-      out.release(); // nullptr contained ptr<file> signals error in creating the log file
-   }
-   return out;
-}
 }  // end anonymous namespace
 
 
 /** The Real McCoy Background worker, while AsyncLogWorker gives the
 * asynchronous API to put job in the background the AsyncLogWorkerImpl
-* does the actual background thread work */
-struct AsyncLogWorkerImpl {
-   AsyncLogWorkerImpl(const tstring& log_prefix, const tstring& log_directory, bool rotate_logs = true, unsigned int max_files_to_rotate = 10, bool time_based_file_names = false);
+* does the actual background thread work.
+* Log records travel on the shared byte ring, on their own typed queue (records_)
+* or on the per-thread rings, which the Active thread drains; only the low volume
+* control operations are sent as Callbacks. Severe records take a second lane
+* (urgent_ring_, serialized like the shared ring) that is written ahead of everything else.
+* With format threads the Active thread only collects batches and writes them,
+* in sequence order, once a formatter thread has rendered them */
+struct AsyncLogWorkerImpl : public AsyncLogger::ActiveDrain {
+   AsyncLogWorkerImpl(const tstring& log_prefix, const tstring& log_directory, const AsyncLogWorkerOptions& options = AsyncLogWorkerOptions(), bool rotate_logs = true, unsigned int max_files_to_rotate = 10, bool time_based_file_names = false);
    ~AsyncLogWorkerImpl();
 
-   void backgroundFileWrite(AsyncLogger::internal::LogEntry message);
-   void backgroundExitFatal(AsyncLogger::internal::FatalMessage fatal_message);
+   // ActiveDrain, called on the Active thread
+   virtual size_t drain(bool drain_all);
+   virtual bool pending() const;
+
+   void formatRecord(AsyncLogger::tick_type tick, const TCHAR* text, size_t text_size, const TCHAR* format, const unsigned char* args, size_t args_size, tstring& buffer, AsyncLogger::TimestampCache* cache = nullptr);
+   void formatRecord(const AsyncLogger::internal::LogEntry& message, tstring& buffer, AsyncLogger::TimestampCache* cache = nullptr);
+   void formatRecord(const AsyncLogger::internal::RecordHeader& record, tstring& buffer, AsyncLogger::TimestampCache* cache = nullptr);
+   size_t drainPipelined(bool drain_all);
+   void markDrainBound();
+   bool drainBoundCollected() const;
+   bool drainBoundReached() const;
+   bool dispatchFormatJob();
+   size_t formatJob(FormatJob& job, AsyncLogger::TimestampCache& cache);
+   size_t writeFormatJob();
+   void startBatch();
+   void noteDequeued(AsyncLogger::tick_type tick);
+   void writeBuffer(const tstring& buffer, unsigned int most_severe_level);
+   bool isUrgent(const AsyncLogger::internal::LogCallSite* call_site) const;
+   bool saveUrgent(const AsyncLogger::internal::LogRecordRef& record);
+   size_t writeUrgentRecords();
+   size_t countPendingRecords() const;
+   bool flushDue(unsigned int most_severe_level) const;
+   void enqueue(AsyncLogger::internal::LogEntry&& message);
+   void saveRecord(const AsyncLogger::internal::LogRecordRef& record);
+   void saveToThreadRing(const AsyncLogger::internal::LogRecordRef& record);
+   ThreadRecordRing* threadRing();
+   void refreshThreadRings();
+   size_t mergeThreadRings(size_t max_records, unsigned int& most_severe_level, FormatJob* job = nullptr);
+   void saveToSharedRing(const AsyncLogger::internal::LogRecordRef& record);
+   size_t readSharedRing(size_t max_records, unsigned int& most_severe_level, FormatJob* job = nullptr);
+   void countDropped(unsigned int level);
+   void countCollected(unsigned int level);
+   void reportDroppedRecords(bool force = false);
+   void flushFile(bool closing = false);
+   void backgroundFileWrite(const AsyncLogger::internal::LogEntry& message);
+   void backgroundExitFatal(const AsyncLogger::internal::FatalMessage& fatal_message, bool written_ahead = false);
    tstring  backgroundChangeLogFile(const tstring& directory, const tstring& file_name, bool rotate = false);
    tstring  backgroundFileName();
 
-   int openFile(tstring file_path, tstring file_name, std::unique_ptr<std::wofstream> &out, bool rotate = false);
+   int openFile(tstring file_path, tstring file_name, std::unique_ptr<AsyncLogger::LogFileSink> &out, bool rotate = false);
 
    tstring log_file_path_;
    tstring log_file_name_; // needed in case of future log file changes of directory
+   mpsc_ring_buffer<AsyncLogger::internal::LogEntry> records_;
+   mpsc_byte_ring urgent_ring_; // the fast lane, also taken by the FATAL message when fast_lane_level is 0
+   const unsigned int fast_lane_level_;
+   const QueueFullPolicy queue_full_policy_;
+   const unsigned int drop_level_;
+   std::atomic<size_t> max_batch_size_;
+
+   const RecordTransport record_transport_;
+   const size_t thread_ring_bytes_;
+   const unsigned long long worker_id_;
+   std::mutex thread_rings_mutex_;
+   std::vector<std::shared_ptr<ThreadRecordRing> > thread_rings_; // registry, under thread_rings_mutex_
+   std::atomic<unsigned long long> thread_rings_generation_;     // bumped on every registry change
+   std::vector<std::shared_ptr<ThreadRecordRing> > polled_rings_; // background thread's copy of the registry
+   unsigned long long polled_generation_;
+   std::vector<std::pair<AsyncLogger::tick_type, size_t> > merge_heap_; // (tick of the ring's oldest record, ring)
+   std::unique_ptr<mpsc_byte_ring> shared_ring_; // kSharedByteRing only
+   unsigned long long ring_records_read_; // records read from the shared and thread rings, and the ring bytes
+   unsigned long long ring_bytes_read_;   // they took: the average record size for countPendingRecords()
+   tstring batch_buffer_; // formatted records of the current batch, reused
+
+   std::vector<std::unique_ptr<RecordFormatter> > formatters_; // format_threads > 0 only
+   std::vector<FormatJob> format_jobs_;   // in flight by sequence number, slot = sequence % size
+   unsigned long long next_job_;          // sequence number of the next batch collected
+   unsigned long long written_job_;       // sequence number of the next batch written
+
+   // drain(true): where the transports ended when the Active thread popped its Callbacks. Only
+   // the records up to there go ahead of them, a steady stream of later ones cannot hold them up
+   size_t records_bound_;
+   size_t shared_ring_bound_;
+   std::vector<std::pair<std::shared_ptr<ThreadRecordRing>, size_t> > thread_ring_bounds_;
+
+   FlushPolicy flush_policy_;
+   std::atomic<size_t> pending_chars_;
+   std::atomic<unsigned long long> flushes_;
+
+   // telemetry, see AsyncLogWorkerStats. Written by the background thread only
+   std::atomic<size_t> queue_depth_;
+   std::atomic<size_t> queue_depth_high_water_;
+   std::atomic<size_t> ring_bytes_;
+   std::atomic<size_t> ring_bytes_high_water_;
+   std::atomic<unsigned long long> records_written_;
+   std::atomic<unsigned long long> bytes_written_;
+   std::atomic<unsigned long long> rotations_;
+   StatsHistogram queue_latency_;
+   StatsHistogram format_time_;
+   StatsHistogram write_time_;
+   long long batch_started_ns_;         // when the current batch was picked up, for queue_latency_
+   steady_time_point batch_started_;
+   unsigned long long last_file_size_;  // sink size after the last write, for bytes_written_
+
+   std::atomic<unsigned long long> dropped_[LOG_ALL + 1]; // by level, written by the producers
+   unsigned long long dropped_reported_[LOG_ALL + 1];     // background thread only
+   // records by level, background thread only: taken off the transports for the next write, and written
+   // to the sink since its last complete flush. The latter are dropped if the sink gives up on its text
+   unsigned long long collected_[LOG_ALL + 1];
+   unsigned long long unflushed_[LOG_ALL + 1];
+   steady_time_point last_drop_report_;
+   steady_time_point last_flush_;
    std::unique_ptr<AsyncLogger::Active> bg_;
-   std::unique_ptr<std::wofstream> outptr_;
-   steady_time_point steady_start_time_;
+   AsyncLogger::LogFileSinkType sink_type_;
+   std::unique_ptr<AsyncLogger::LogFileSink> sink_;
+   AsyncLogger::tick_type start_tick_;
+   AsyncLogger::TimestampCache timestamp_cache_; // record prefixes, used on the background thread only
 
    unsigned long long file_size_kb;
+   const unsigned long long rotate_file_kb_; // 0: no size rotation
 
    int change_log_file_retry;
 
@@ -268,7 +544,6 @@ struct AsyncLogWorkerImpl {
  private:
    AsyncLogWorkerImpl& operator=(const AsyncLogWorkerImpl&); // c++11 feature not yet in vs2010 = delete;
    AsyncLogWorkerImpl(const AsyncLogWorkerImpl& other); // c++11 feature not yet in vs2010 = delete;
-   inline std::wofstream& filestream() {return *(outptr_.get());}
 
    ICriticalSection change_log_path;
 };
@@ -279,11 +554,11 @@ tstringstream getLoggerInittext()
 	//  Day Month Date Time Year: is written as "%a %b %d %H:%M:%S %Y" and formatted output as : Wed Sep 19 08:28:16 2012
 	ss_entry << "\n***************************************************************************************************************************************************\n\n";
 	ss_entry << _T("\t\t\t\tLogging Started from: ") << AsyncLogger::localtime_formatted(AsyncLogger::systemtime_now(), _T("%a %b %d %H:%M:%S %Y")) << _T("\n");
-	ss_entry << _T("\t\t\t\tLOG format: [YYYY/MM/DD hh:mm:ss uuu* [Process ID] [ loglevel ] [FILE:LINE] ] message\t\t (uuu*: microsecond counter since app start)\n");
+	ss_entry << _T("\t\t\t\tLOG format: [YYYY/MM/DD hh:mm:ss.uuuuuu uuu* [Process ID] [ loglevel ] [FILE:LINE] ] message\t\t (time of the LOG call, uuu*: microseconds since logger start)\n");
 
 	ss_entry << _T("\t\t\t\tLOG levels(Lower number means high priority):\t\t FATAL = 0\t CRITICAL = 1\t WARNING = 2 \t INFO = 3 \t DEBUG = 4\t ALL = 5\n");
 
-	ss_entry << _T("\t\t\t\tCurrent LOG level: ") << log_level_strings[log_level] << _T("\n\n");
+	ss_entry << _T("\t\t\t\tCurrent LOG level: ") << log_level_strings[AsyncLogger::logLevel()] << _T("\n\n");
 
 	ss_entry << _T("\t\t\t\tProduct Name: ") << _product_name << _T("\n\t\t\t\tVersion: ") << _product_version << _T("\n");
 
@@ -301,20 +576,59 @@ tstringstream getLoggerInittext()
 
 //
 // Private API implementation : AsyncLogWorkerImpl
-AsyncLogWorkerImpl::AsyncLogWorkerImpl(const tstring& log_prefix, const tstring& log_directory, bool rotate_logs, unsigned int max_files_to_rotate, bool time_based_file_names)
+AsyncLogWorkerImpl::AsyncLogWorkerImpl(const tstring& log_prefix, const tstring& log_directory, const AsyncLogWorkerOptions& options, bool rotate_logs, unsigned int max_files_to_rotate, bool time_based_file_names)
    : log_file_path_(log_directory)
    , log_file_name_(log_prefix)
    , _mRotate_log_files(rotate_logs)
    , _mMax_files_to_rotate(max_files_to_rotate)
    , _mTime_based_file_names(time_based_file_names)
-   , bg_(AsyncLogger::Active::createActive())
-   , outptr_(new std::wofstream)
-   , steady_start_time_(std::chrono::steady_clock::now()) 
+   , records_(options.queue_capacity)
+   , urgent_ring_(options.fast_lane_bytes)
+   , fast_lane_level_(options.fast_lane_level)
+   , queue_full_policy_(options.queue_full_policy)
+   , drop_level_(options.drop_level)
+   , max_batch_size_(LOG_RECORD_BATCH_SIZE)
+   , record_transport_(recordTransport(options))
+   , thread_ring_bytes_(options.thread_ring_bytes)
+   , worker_id_(g_next_worker_id.fetch_add(1, std::memory_order_relaxed))
+   , thread_rings_generation_(0)
+   , polled_generation_(0)
+   , shared_ring_(kSharedByteRing == record_transport_ ? new mpsc_byte_ring(options.shared_ring_bytes) : nullptr)
+   , ring_records_read_(0)
+   , ring_bytes_read_(0)
+   , next_job_(0)
+   , written_job_(0)
+   , records_bound_(0)
+   , shared_ring_bound_(0)
+   , pending_chars_(0)
+   , flushes_(0)
+   , queue_depth_(0)
+   , queue_depth_high_water_(0)
+   , ring_bytes_(0)
+   , ring_bytes_high_water_(0)
+   , records_written_(0)
+   , bytes_written_(0)
+   , rotations_(0)
+   , batch_started_ns_(0)
+   , last_file_size_(0)
+   , last_drop_report_(std::chrono::steady_clock::now())
+   , last_flush_(std::chrono::steady_clock::now())
+   , sink_type_(options.sink_type)
+   , start_tick_(AsyncLogger::tickNow())
+   , rotate_file_kb_(options.rotate_file_kb)
 
 { // TODO: ha en timer function steadyTimer som har koll på start
    
 	is_logging_started = false;
 
+	for (unsigned int level = 0; level <= LOG_ALL; ++level)
+	{
+		dropped_[level].store(0, std::memory_order_relaxed);
+		dropped_reported_[level] = 0;
+		collected_[level] = 0;
+		unflushed_[level] = 0;
+	}
+
 	log_file_name_ = prefixSanityFix(log_prefix);
 
 	change_log_file_retry = 0;
@@ -328,15 +642,9 @@ AsyncLogWorkerImpl::AsyncLogWorkerImpl(const tstring& log_prefix, const tstring&
 		   abort();
 	   }
 
-		openFile(log_file_path_, log_file_name_, outptr_);
-
-		if (outptr_)
-		{
-			const std::locale utf8_locale = std::locale(std::locale(), new std::codecvt_utf8<wchar_t>());
-			outptr_->imbue(utf8_locale);
-		}
+		openFile(log_file_path_, log_file_name_, sink_);
 
-		if (!outptr_) 
+		if (!sink_) 
 		{
 			std::wcerr << _T("Cannot write logfile to location, attempting current directory") << std::endl;
 		}
@@ -346,9 +654,7 @@ AsyncLogWorkerImpl::AsyncLogWorkerImpl(const tstring& log_prefix, const tstring&
 
 			tstringstream ss_entry = getLoggerInittext();
 
-			backgroundFileWrite(LogEntry(ss_entry.str(), AsyncLogger::internal::systemtime_now()));
-
-			outptr_->fill(_T('0'));
+			backgroundFileWrite(LogEntry(ss_entry.str(), AsyncLogger::tickNow()));
 		}
    }
    CATCH_ALL(e)
@@ -357,9 +663,27 @@ AsyncLogWorkerImpl::AsyncLogWorkerImpl(const tstring& log_prefix, const tstring&
    }
    END_CATCH_ALL
 
+   if (shared_ring_ && options.thread_options.numa_node >= 0)
+   {
+      AsyncLogger::bindMemoryToNumaNode(shared_ring_->storage(), shared_ring_->capacity(), options.thread_options.numa_node);
+   }
+
+   if (options.format_threads)
+   {
+      format_jobs_.resize(options.format_threads * LOG_FORMAT_JOBS_PER_THREAD);
+      for (unsigned int i = 0; i < options.format_threads; ++i)
+      {
+         std::unique_ptr<RecordFormatter> formatter(new RecordFormatter());
+         formatter->thread_ = AsyncLogger::Active::createActive(AsyncLogger::kLockFreeRingQueue, ACTIVE_DEFAULT_RING_CAPACITY, nullptr, options.format_wait_policy, options.format_thread_options);
+         formatters_.push_back(std::move(formatter));
+      }
+   }
+
+   // started last: from here on the Active thread calls drain()
+   bg_ = AsyncLogger::Active::createActive(AsyncLogger::kLockFreeRingQueue, ACTIVE_DEFAULT_RING_CAPACITY, this, options.wait_policy, options.thread_options);
 }
 
-int AsyncLogWorkerImpl::openFile(tstring file_path, tstring file_name, std::unique_ptr<std::wofstream> &out, bool rotate)
+int AsyncLogWorkerImpl::openFile(tstring file_path, tstring file_name, std::unique_ptr<AsyncLogger::LogFileSink> &out, bool rotate)
 {
 	int result = -1;
 
@@ -370,10 +694,14 @@ int AsyncLogWorkerImpl::openFile(tstring file_path, tstring file_name, std::uniq
 		tstring log_file; 
 		result = createLogFileName(log_file_with_path, log_file, _mMax_files_to_rotate, rotate /*append logs to the existing log file*/, _mTime_based_file_names /*are we using unique time based file names?*/);
 
-		out = createLogFile(log_file);
-		if (!out) {
+		out = AsyncLogger::createLogFileSink(sink_type_);
+		if (!out->open(log_file)) {
+			out.reset(); // nullptr sink signals error in creating the log file
 			std::wcerr << _T("Cannot write logfile to location, attempting current directory") << std::endl;
 		}
+		else {
+			last_file_size_ = out->size(); // appended to an existing file, only the growth counts as written
+		}
 	
 	}
 	CATCH_ALL(e)
@@ -388,201 +716,1166 @@ int AsyncLogWorkerImpl::openFile(tstring file_path, tstring file_name, std::uniq
 
 AsyncLogWorkerImpl::~AsyncLogWorkerImpl() {
    tstringstream ss_exit;
-   bg_.reset(); // flush the log queue
+   bg_.reset(); // flush the log queue, the formatters are idle after it
+   formatters_.clear();
+   reportDroppedRecords(true);
    ss_exit << _T("\n\t\tLogger file shutdown at: ") << AsyncLogger::localtime_formatted(AsyncLogger::systemtime_now(), time_formatted);
-   filestream() << ss_exit.str() << std::flush;
+   if (sink_ && sink_->isOpen())
+   {
+      const tstring exit_text = ss_exit.str();
+      sink_->write(exit_text.data(), exit_text.size());
+      sink_->flush();
+   }
 }
 
 
-void AsyncLogWorkerImpl::backgroundFileWrite(LogEntry message) {
-
-   TRY
-   {
-	   if (!(is_logging_started && outptr_))
-	   {
-		   return;
-	   }
+// Pops up to the batch size of records, formats them back to back into batch_buffer_
+// and hands the whole batch to the file in one write. Shared ring records are read in
+// place and their space is released once the batch is written
+size_t AsyncLogWorkerImpl::drain(bool drain_all) {
+	if (!formatters_.empty())
+	{
+		return drainPipelined(drain_all);
+	}
 
-	   if (filestream())
-	   {
-		   std::wofstream& out(filestream());
+	const size_t max_batch_size = max_batch_size_.load(std::memory_order_relaxed);
+	size_t handled = 0;
+	LogEntry message;
 
-		   if (out)
-		   {
-			   auto log_time = message.timestamp_;
-			   auto steady_time = std::chrono::steady_clock::now();
+	if (drain_all)
+	{
+		markDrainBound();
+	}
 
-			   out.seekp(0, ios_base::end);
+	for (;;)
+	{
+		startBatch();
+		handled += writeUrgentRecords(); // checked before every batch, a backlog delays them one batch at most
 
-			   out << _T("\n");
-			   out << AsyncLogger::localtime_formatted(log_time, date_formatted);
-			   out << _T(" ") << AsyncLogger::localtime_formatted(log_time, time_formatted);
-			   out << _T(" ") << chrono::duration_cast<std::chrono::microseconds>(steady_time - steady_start_time_).count();
+		size_t batched = 0;
+		unsigned int most_severe_level = LOG_ALL;
 
-			   out << _T(" ") << currentProcessPid;
+		while (batched < max_batch_size && records_.try_pop(message))
+		{
+			noteDequeued(message.tick_);
+			formatRecord(message, batch_buffer_);
+			most_severe_level = std::min(most_severe_level, recordLevel(message));
+			countCollected(recordLevel(message));
+			++batched;
+		}
 
-			   out << _T("  ") << message.msg_ << std::flush;
+		if (shared_ring_ && batched < max_batch_size)
+		{
+			batched += readSharedRing(max_batch_size - batched, most_severe_level);
+		}
 
-			   file_size_kb =  (out.tellp()) / 1024;
+		if (kPerThreadRings == record_transport_ && batched < max_batch_size)
+		{
+			batched += mergeThreadRings(max_batch_size - batched, most_severe_level);
+		}
 
-			   if (file_size_kb > 1024 && change_log_file_retry < MAX_LOG_FILE_ROTATE_RETRIES)
-			   {
-				   file_size_kb = 0;
+		if (batched)
+		{
+			format_time_.add(nanosecondsSince(batch_started_));
+			writeBuffer(batch_buffer_, most_severe_level);
+			batch_buffer_.clear(); // keeps its capacity for the next batch
+			handled += batched;
+			records_written_.fetch_add(batched, std::memory_order_relaxed);
 
-				   if (change_log_path.TryCaptureMutexLock())
-				   {
-						change_log_file_retry ++;
-						change_log_path.ReleaseLock();
-						backgroundChangeLogFile(log_file_path_, log_file_name_, true);
-				   }
-			   }
-		   }
-	   }
-   }
-   CATCH_ALL(e)
-   {
-   
-   }
-   END_CATCH_ALL
-}
+			if (shared_ring_)
+			{
+				shared_ring_->release();
+			}
+		}
+		else if (pending_chars_.load(std::memory_order_relaxed) && flushDue(LOG_ALL))
+		{
+			flushFile(); // flush interval passed while the queue was idle
+		}
 
+		reportDroppedRecords();
 
-void AsyncLogWorkerImpl::backgroundExitFatal(FatalMessage fatal_message) 
-{
-	backgroundFileWrite(fatal_message.message_);
-	LogEntry flushEntry(_T("Log flushed successfully to disk \nExiting...\n\n"), AsyncLogger::internal::systemtime_now());
-	backgroundFileWrite(flushEntry);
+		if (!drain_all || drainBoundReached())
+		{
+			break;
+		}
 
-	std::wcerr << _T("Asynclog exiting after receiving fatal event") << std::endl;
-	std::wcerr << _T("Log file at: [") << log_file_path_ << _T("]\n") << std::endl << std::flush;
-	filestream().close();
+		if (0 == batched)
+		{
+			std::this_thread::yield(); // a producer reserved a slot but has not published it yet
+		}
+	}
 
-	AsyncLogger::shutDownLogging(); // only an initialized logger can recieve a fatal message. So shutting down logging now is fine.
-	exitWithDefaultSignalHandler(fatal_message.signal_id_);
-	perror("Asynclog exited after receiving FATAL trigger. Flush message status: "); // should never reach this point
+	return handled;
 }
 
 
-tstring AsyncLogWorkerImpl::backgroundChangeLogFile(const tstring& directory, const tstring& file, bool _rotate) {
+// format_threads > 0: keeps every formatter busy with a batch, LOG_FORMAT_JOBS_PER_THREAD
+// each at most, and writes the oldest batch once formatted. The batches are written in
+// the order they were collected, so the file order is the one of the serial drain()
+size_t AsyncLogWorkerImpl::drainPipelined(bool drain_all) {
+	size_t handled = 0;
 
-	TRY
+	if (drain_all)
 	{
-		{
-
-			LockGuard<ICriticalSection> lock_holder(change_log_path);
-
-			// setting the new log as active
-			tstring old_log = log_file_path_ + _T("\\") + log_file_name_ + _T(".log");
+		markDrainBound();
+	}
 
-			if (outptr_)
-			{
-				if (outptr_->is_open())
-				{
-					is_logging_started = false;
-					outptr_->close();
-				}
-			}
+	for (;;)
+	{
+		startBatch();
+		handled += writeUrgentRecords();
 
-			
+		// past the bound nothing new is collected, the batches in flight are written and it returns
+		while (next_job_ - written_job_ < format_jobs_.size() && !(drain_all && drainBoundCollected()) && dispatchFormatJob())
+		{
+		}
 
-			std::unique_ptr<std::wofstream> log_stream = nullptr;
+		const bool in_flight = (next_job_ != written_job_);
 
-			int result = openFile(directory, file, log_stream, _rotate);
+		if (in_flight)
+		{
+			handled += writeFormatJob(); // waits for it if it is not formatted yet
+		}
+		else if (pending_chars_.load(std::memory_order_relaxed) && flushDue(LOG_ALL))
+		{
+			flushFile(); // flush interval passed while the queue was idle
+		}
 
-			if (nullptr == log_stream) 
-			{
+		reportDroppedRecords();
 
-				openFile(log_file_path_, log_file_name_, log_stream, _rotate);
+		if (!drain_all || drainBoundReached())
+		{
+			break;
+		}
 
-				if (!log_stream) 
-				{
-					std::wcerr << _T("Cannot write logfile to location, attempting current directory") << std::endl;
-				}
-				else
-				{
-					outptr_ = std::move(log_stream);
-					is_logging_started = true;
-				}
-			}
-			else
-			{
-				log_file_name_ = file;
-				log_file_path_ = directory;
-				outptr_ = std::move(log_stream);
+		if (!in_flight)
+		{
+			std::this_thread::yield(); // a producer reserved a slot but has not published it yet
+		}
+	}
 
-				is_logging_started = true;
+	return handled;
+}
 
-				tstringstream ss_entry;
 
-				if (ERROR_SUCCESS == result)
-				{
-					ss_entry = getLoggerInittext();
+// drain(true) is called right after the Callbacks were popped: every record logged before
+// one of them is enqueued by now, positions taken here cover them
+void AsyncLogWorkerImpl::markDrainBound() {
+	records_bound_ = records_.enqueue_position();
 
-					ss_entry << _T("\n\tNew log file. The previous log file was at: ");
-					ss_entry << old_log;
-				}
-				else
-				{
-					ss_entry << _T("\n\tChanging logfile failed");
-				}
+	if (shared_ring_)
+	{
+		shared_ring_bound_ = shared_ring_->write_position();
+	}
 
-				backgroundFileWrite(LogEntry(ss_entry.str(), AsyncLogger::internal::systemtime_now()));
-			}
+	thread_ring_bounds_.clear();
+	if (kPerThreadRings == record_transport_)
+	{
+		refreshThreadRings(); // a thread that logged before a Callback has registered its ring before it
+		for (size_t i = 0; i < polled_rings_.size(); ++i)
+		{
+			thread_ring_bounds_.push_back(std::make_pair(polled_rings_[i], polled_rings_[i]->ring_.write_position()));
 		}
 	}
-	CATCH_ALL(e)
+}
+
+
+// every record up to the bound of markDrainBound() is taken off the transports. Records
+// still being published before it (a slot reserved, not committed yet) are waited for
+bool AsyncLogWorkerImpl::drainBoundCollected() const {
+	if (!mpsc_ring_buffer<LogEntry>::reached(records_.dequeue_position(), records_bound_))
 	{
+		return false;
+	}
 
+	if (shared_ring_ && !mpsc_byte_ring::reached(shared_ring_->read_position(), shared_ring_bound_))
+	{
+		return false;
 	}
-	END_CATCH_ALL
 
+	for (size_t i = 0; i < thread_ring_bounds_.size(); ++i)
+	{
+		if (!spsc_byte_ring::reached(thread_ring_bounds_[i].first->ring_.read_position(), thread_ring_bounds_[i].second))
+		{
+			return false;
+		}
+	}
 
-	return tstring(log_file_path_ + log_file_name_ + _T(".log"));
+	return true;
 }
 
-tstring  AsyncLogWorkerImpl::backgroundFileName() {
-   return log_file_path_;
+
+// ... and written, format threads included
+bool AsyncLogWorkerImpl::drainBoundReached() const {
+	return next_job_ == written_job_ && drainBoundCollected();
 }
 
 
-void AsyncLogWorker::setlogLevel(unsigned int level)
-{
-	log_level = level;
-}
+// collects the next batch of records, without formatting them, and hands it to the
+// formatter of its sequence number. \return false if there was nothing to collect
+bool AsyncLogWorkerImpl::dispatchFormatJob() {
+	const size_t max_batch_size = max_batch_size_.load(std::memory_order_relaxed);
+	FormatJob& job = format_jobs_[next_job_ % format_jobs_.size()];
 
-//
-// *****   BELOW AsyncLogWorker    *****
-// Public API implementation
-//
-AsyncLogWorker::AsyncLogWorker(const tstring& log_prefix, const tstring& log_directory, UINT level, const tstring& product_name , const tstring& version )
-   :  pimpl_(new AsyncLogWorkerImpl(log_prefix, log_directory))
-{
+	startBatch();
+	LogEntry message;
 
-	log_level = level;
+	job.most_severe_level_ = LOG_ALL;
+	while (job.entries_.size() < max_batch_size && records_.try_pop(message))
+	{
+		noteDequeued(message.tick_);
+		job.most_severe_level_ = std::min(job.most_severe_level_, recordLevel(message));
+		countCollected(recordLevel(message));
+		job.entries_.push_back(std::move(message));
+	}
 
-	_product_name = product_name;
+	if (shared_ring_ && job.size() < max_batch_size)
+	{
+		readSharedRing(max_batch_size - job.size(), job.most_severe_level_, &job);
+		job.shared_ring_position_ = shared_ring_->read_position();
+	}
 
-	_product_version = version;
+	if (kPerThreadRings == record_transport_ && job.size() < max_batch_size)
+	{
+		mergeThreadRings(max_batch_size - job.size(), job.most_severe_level_, &job);
+		for (size_t i = 0; i < polled_rings_.size(); ++i)
+		{
+			job.ring_positions_.push_back(std::make_pair(polled_rings_[i], polled_rings_[i]->ring_.read_position()));
+		}
+	}
 
-	assert((pimpl_ != nullptr) && "should never happen");
-}
+	if (0 == job.size())
+	{
+		job.ring_positions_.clear();
+		return false;
+	}
 
-AsyncLogWorker::~AsyncLogWorker() {
-	if (pimpl_)
-		pimpl_.reset();
+	moveLevelCounts(collected_, job.levels_);
 
-   AsyncLogger::shutDownLoggingForActiveOnly(this);
-   std::wcerr << _T("\nExiting...") << _T("\n") << std::flush;
+	RecordFormatter* formatter = formatters_[next_job_ % formatters_.size()].get();
+	AsyncLogWorkerImpl* worker = this;
+	FormatJob* batch = &job;
+	job.formatted_ = AsyncLogger::spawn_task([worker, batch, formatter]() { return worker->formatJob(*batch, formatter->timestamp_cache_); }, formatter->thread_.get());
+	++next_job_;
+	return true;
 }
 
-void AsyncLogWorker::save(const AsyncLogger::internal::LogEntry& msg) {
-	if ( pimpl_ && pimpl_->bg_)
-		pimpl_->bg_->send(std::bind(&AsyncLogWorkerImpl::backgroundFileWrite, pimpl_.get(), msg));
-}
 
-void AsyncLogWorker::fatal(AsyncLogger::internal::FatalMessage fatal_message) {
-	if ( pimpl_ && pimpl_->bg_)
-		pimpl_->bg_->send(std::bind(&AsyncLogWorkerImpl::backgroundExitFatal, pimpl_.get(), fatal_message));
+// runs on a formatter thread. Only reads the records, the background thread owns the rings
+size_t AsyncLogWorkerImpl::formatJob(FormatJob& job, AsyncLogger::TimestampCache& cache) {
+	const steady_time_point started = std::chrono::steady_clock::now();
+
+	for (size_t i = 0; i < job.entries_.size(); ++i)
+	{
+		formatRecord(job.entries_[i], job.text_, &cache);
+	}
+
+	for (size_t i = 0; i < job.records_.size(); ++i)
+	{
+		formatRecord(*job.records_[i], job.text_, &cache);
+	}
+
+	job.format_ns_ = nanosecondsSince(started);
+	return job.size();
+}
+
+
+// writes the oldest batch in flight and gives its ring space back to the producers
+size_t AsyncLogWorkerImpl::writeFormatJob() {
+	FormatJob& job = format_jobs_[written_job_ % format_jobs_.size()];
+	size_t written = 0;
+
+	try
+	{
+		written = job.formatted_.get(); // rethrows what formatJob() threw
+	}
+	catch (...)
+	{
+		// what was formatted is written, the rest of the batch is lost. The slot and the
+		// ring space are given back all the same, the next batches must not wait for them
+		job.format_ns_ = 0;
+		job.text_ += _T("\n\tAsynclog: a batch of ");
+		appendDecimal(job.size(), job.text_);
+		job.text_ += _T(" records could not be formatted, some of them are missing");
+	}
+
+	format_time_.add(job.format_ns_);
+	moveLevelCounts(job.levels_, collected_);
+	writeBuffer(job.text_, job.most_severe_level_);
+	records_written_.fetch_add(written, std::memory_order_relaxed);
+
+	if (shared_ring_)
+	{
+		shared_ring_->release(job.shared_ring_position_);
+	}
+
+	for (size_t i = 0; i < job.ring_positions_.size(); ++i)
+	{
+		job.ring_positions_[i].first->ring_.release(job.ring_positions_[i].second);
+	}
+
+	// the buffers keep their capacity for the next batch in this slot
+	job.entries_.clear();
+	job.records_.clear();
+	job.ring_positions_.clear();
+	job.text_.clear();
+	++written_job_;
+
+	return written;
+}
+
+
+// samples the queue depths and notes when the next batch is picked up
+void AsyncLogWorkerImpl::startBatch() {
+	size_t ring_bytes = shared_ring_ ? shared_ring_->used_bytes() : 0;
+	ring_bytes += urgent_ring_.used_bytes();
+	for (size_t i = 0; i < polled_rings_.size(); ++i)
+	{
+		ring_bytes += polled_rings_[i]->ring_.used_bytes();
+	}
+
+	storeWithHighWater(queue_depth_, queue_depth_high_water_, records_.size());
+	storeWithHighWater(ring_bytes_, ring_bytes_high_water_, ring_bytes);
+
+	batch_started_ = std::chrono::steady_clock::now();
+	batch_started_ns_ = AsyncLogger::ticksToSystemNanoseconds(AsyncLogger::tickNow());
+}
+
+
+// time from the LOG call until the record was picked up, one clock read per batch
+void AsyncLogWorkerImpl::noteDequeued(AsyncLogger::tick_type tick) {
+	queue_latency_.add(batch_started_ns_ - AsyncLogger::ticksToSystemNanoseconds(tick));
+}
+
+
+// called by the producers, applies the QueueFullPolicy when the queue is full
+void AsyncLogWorkerImpl::enqueue(LogEntry&& message) {
+	if (isUrgent(message.call_site_) && saveUrgent(recordRef(message)))
+	{
+		return;
+	}
+
+	if (records_.try_push(std::move(message)))
+	{
+		return;
+	}
+
+	switch (queue_full_policy_)
+	{
+	case kDropNewest:
+		countDropped(recordLevel(message));
+		return;
+
+	case kDropOldest:
+		{
+			LogEntry oldest;
+			while (!records_.try_push(std::move(message)))
+			{
+				if (records_.try_pop(oldest))
+				{
+					countDropped(recordLevel(oldest));
+				}
+				else
+				{
+					std::this_thread::yield(); // the background thread emptied a slot meanwhile
+				}
+			}
+		}
+		return;
+
+	case kDropBelowSeverity:
+		if (recordLevel(message) > drop_level_)
+		{
+			countDropped(recordLevel(message));
+			return;
+		}
+		break;
+
+	default:
+		break;
+	}
+
+	records_.push(std::move(message)); // yields while the queue is full
+}
+
+
+void AsyncLogWorkerImpl::countDropped(unsigned int level) {
+	dropped_[level <= LOG_ALL ? level : LOG_ALL].fetch_add(1, std::memory_order_relaxed);
+}
+
+
+void AsyncLogWorkerImpl::countCollected(unsigned int level) {
+	++collected_[level <= LOG_ALL ? level : LOG_ALL];
+}
+
+
+// writes "N messages dropped" once per LOG_DROPPED_REPORT_INTERVAL_MS while records are being dropped
+void AsyncLogWorkerImpl::reportDroppedRecords(bool force) {
+	const steady_time_point now = std::chrono::steady_clock::now();
+	if (!force && now - last_drop_report_ < std::chrono::milliseconds(LOG_DROPPED_REPORT_INTERVAL_MS))
+	{
+		return;
+	}
+	last_drop_report_ = now;
+
+	unsigned long long since_report[LOG_ALL + 1];
+	unsigned long long total = 0;
+
+	for (unsigned int level = 0; level <= LOG_ALL; ++level)
+	{
+		const unsigned long long dropped = dropped_[level].load(std::memory_order_relaxed);
+		since_report[level] = dropped - dropped_reported_[level];
+		dropped_reported_[level] = dropped;
+		total += since_report[level];
+	}
+
+	if (total)
+	{
+		tstringstream ss_levels; // only built when there is something to report
+		for (unsigned int level = 0; level <= LOG_ALL; ++level)
+		{
+			if (since_report[level])
+			{
+				ss_levels << _T(" ") << log_level_strings[level] << _T("=") << since_report[level];
+			}
+		}
+
+		tstringstream ss_report;
+		ss_report << _T("\n\tAsynclog: ") << total << _T(" messages dropped, the log queue was full or the log file could not be written [") << ss_levels.str() << _T(" ]");
+		backgroundFileWrite(LogEntry(ss_report.str(), AsyncLogger::tickNow()));
+	}
+}
+
+
+bool AsyncLogWorkerImpl::pending() const {
+	if (!records_.empty() || !urgent_ring_.empty() || (shared_ring_ && !shared_ring_->empty()) || next_job_ != written_job_)
+	{
+		return true;
+	}
+
+	if (kPerThreadRings == record_transport_)
+	{
+		if (polled_generation_ != thread_rings_generation_.load(std::memory_order_acquire))
+		{
+			return true; // a new thread registered, it may have logged already
+		}
+
+		for (size_t i = 0; i < polled_rings_.size(); ++i)
+		{
+			if (!polled_rings_[i]->ring_.empty())
+			{
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+
+// kPerThreadRings: picks up newly registered rings and reclaims drained rings of exited threads
+void AsyncLogWorkerImpl::refreshThreadRings() {
+	bool reclaim = false;
+
+	for (size_t i = 0; i < polled_rings_.size() && !reclaim; ++i)
+	{
+		// closed_ first: everything the thread committed before exiting is visible after it
+		reclaim = polled_rings_[i]->closed_.load(std::memory_order_acquire) && polled_rings_[i]->ring_.empty();
+	}
+
+	if (reclaim)
+	{
+		std::lock_guard<std::mutex> lock(thread_rings_mutex_);
+		thread_rings_.erase(std::remove_if(thread_rings_.begin(), thread_rings_.end(),
+			[](const std::shared_ptr<ThreadRecordRing>& ring) {
+				return ring->closed_.load(std::memory_order_acquire) && ring->ring_.empty();
+			}), thread_rings_.end());
+		thread_rings_generation_.fetch_add(1, std::memory_order_acq_rel);
+	}
+
+	if (polled_generation_ != thread_rings_generation_.load(std::memory_order_acquire))
+	{
+		std::lock_guard<std::mutex> lock(thread_rings_mutex_);
+		polled_rings_ = thread_rings_;
+		polled_generation_ = thread_rings_generation_.load(std::memory_order_relaxed);
+	}
+}
+
+
+// k-way merge of the thread rings by the tick of the LOG call, formatted into batch_buffer_
+// Records are read in place and released as soon as they are formatted. With a job they are
+// only collected, the job releases them once written
+size_t AsyncLogWorkerImpl::mergeThreadRings(size_t max_records, unsigned int& most_severe_level, FormatJob* job) {
+	typedef std::pair<AsyncLogger::tick_type, size_t> merge_entry;
+	const std::greater<merge_entry> oldest_first;
+
+	refreshThreadRings();
+	merge_heap_.clear();
+
+	size_t size = 0;
+	for (size_t i = 0; i < polled_rings_.size(); ++i)
+	{
+		const unsigned char* next = polled_rings_[i]->ring_.peek(size);
+		if (next)
+		{
+			merge_heap_.push_back(merge_entry(reinterpret_cast<const RecordHeader*>(next)->tick, i));
+		}
+	}
+	std::make_heap(merge_heap_.begin(), merge_heap_.end(), oldest_first);
+
+	size_t merged = 0;
+	while (merged < max_records && !merge_heap_.empty())
+	{
+		std::pop_heap(merge_heap_.begin(), merge_heap_.end(), oldest_first);
+		const size_t ring_index = merge_heap_.back().second;
+		merge_heap_.pop_back();
+
+		spsc_byte_ring& ring = polled_rings_[ring_index]->ring_;
+		const RecordHeader* record = reinterpret_cast<const RecordHeader*>(ring.peek(size));
+		noteDequeued(record->tick);
+		most_severe_level = std::min(most_severe_level, recordLevel(record->call_site));
+		countCollected(recordLevel(record->call_site));
+		const size_t read_from = ring.read_position();
+		ring.advance();
+		ring_bytes_read_ += ring.read_position() - read_from;
+		++merged;
+
+		if (job)
+		{
+			job->records_.push_back(record);
+		}
+		else
+		{
+			formatRecord(*record, batch_buffer_);
+			ring.release();
+		}
+
+		const unsigned char* next = ring.peek(size);
+		if (next)
+		{
+			merge_heap_.push_back(merge_entry(reinterpret_cast<const RecordHeader*>(next)->tick, ring_index));
+			std::push_heap(merge_heap_.begin(), merge_heap_.end(), oldest_first);
+		}
+	}
+
+	ring_records_read_ += merged;
+	return merged;
+}
+
+
+// kSharedByteRing: formats the committed records in reservation order, or only collects
+// them into job. They stay in the ring, they are released after the file write
+size_t AsyncLogWorkerImpl::readSharedRing(size_t max_records, unsigned int& most_severe_level, FormatJob* job) {
+	const size_t read_from = shared_ring_->read_position();
+	size_t read = 0;
+	size_t size = 0;
+	const unsigned char* next = nullptr;
+
+	while (read < max_records && nullptr != (next = shared_ring_->peek(size)))
+	{
+		const RecordHeader* record = reinterpret_cast<const RecordHeader*>(next);
+		noteDequeued(record->tick);
+		if (job)
+		{
+			job->records_.push_back(record);
+		}
+		else
+		{
+			formatRecord(*record, batch_buffer_);
+		}
+		most_severe_level = std::min(most_severe_level, recordLevel(record->call_site));
+		countCollected(recordLevel(record->call_site));
+		shared_ring_->advance();
+		++read;
+	}
+
+	ring_records_read_ += read;
+	ring_bytes_read_ += shared_ring_->read_position() - read_from;
+	return read;
+}
+
+
+// the fast lane takes the records of the call sites at fast_lane_level_ or more severe, none if it is 0
+// the logger's own entries (no call site) always take the normal lane
+bool AsyncLogWorkerImpl::isUrgent(const LogCallSite* call_site) const {
+	return fast_lane_level_ && call_site && call_site->level_ <= fast_lane_level_;
+}
+
+
+// serializes the record into the fast lane, no allocation
+// \return false when the fast lane is full or too small for it: it then takes the normal lane
+bool AsyncLogWorkerImpl::saveUrgent(const LogRecordRef& record) {
+	unsigned char* at = urgent_ring_.reserve(serializedRecordSize(record));
+	if (nullptr == at)
+	{
+		return false;
+	}
+
+	serializeRecord(record, at);
+	urgent_ring_.commit(at);
+	return true;
+}
+
+
+// Writes the fast lane records in one write and flushes them, whatever the FlushPolicy says.
+// Only the records reserved when it starts are taken: a steady stream of new ones waits for
+// the next batch instead of holding up the normal lane. Each record tells how many records
+// were still pending on the normal lane when it went ahead
+size_t AsyncLogWorkerImpl::writeUrgentRecords() {
+	if (urgent_ring_.empty())
+	{
+		return 0;
+	}
+
+	const size_t bound = urgent_ring_.write_position();
+	const size_t behind = countPendingRecords();
+	size_t written = 0;
+	size_t size = 0;
+	const unsigned char* next = nullptr;
+	tstring& buffer = batch_buffer_; // empty between batches
+
+	while (!mpsc_byte_ring::reached(urgent_ring_.read_position(), bound) && nullptr != (next = urgent_ring_.peek(size)))
+	{
+		const RecordHeader* record = reinterpret_cast<const RecordHeader*>(next);
+		noteDequeued(record->tick);
+		formatRecord(*record, buffer);
+		countCollected(recordLevel(record->call_site));
+		if (behind)
+		{
+			buffer += _T("\t[written ahead of ");
+			appendDecimal(behind, buffer);
+			buffer += _T(" pending lower priority records]");
+		}
+		urgent_ring_.advance();
+		++written;
+	}
+
+	if (0 == written)
+	{
+		return 0; // the oldest reservation is not committed yet
+	}
+
+	writeBuffer(buffer, FATAL);
+	buffer.clear();
+	urgent_ring_.release();
+	records_written_.fetch_add(written, std::memory_order_relaxed);
+
+	if (pending_chars_.load(std::memory_order_relaxed))
+	{
+		flushFile();
+	}
+
+	return written;
+}
+
+
+// records waiting on the normal lane, background thread only. The byte rings only tell
+// their backlog in bytes, it is divided by the average size of the records read from them
+// so far (a serialized RecordHeader until the first one is read)
+size_t AsyncLogWorkerImpl::countPendingRecords() const {
+	size_t count = records_.size();
+
+	for (unsigned long long sequence = written_job_; sequence != next_job_; ++sequence)
+	{
+		count += format_jobs_[sequence % format_jobs_.size()].size();
+	}
+
+	size_t ring_bytes = shared_ring_ ? shared_ring_->write_position() - shared_ring_->read_position() : 0;
+	for (size_t i = 0; i < polled_rings_.size(); ++i)
+	{
+		ring_bytes += polled_rings_[i]->ring_.write_position() - polled_rings_[i]->ring_.read_position();
+	}
+
+	if (ring_bytes)
+	{
+		const unsigned long long average = ring_records_read_ ? std::max(1ULL, ring_bytes_read_ / ring_records_read_) : sizeof(RecordHeader);
+		count += static_cast<size_t>((ring_bytes + average - 1) / average);
+	}
+
+	return count;
+}
+
+
+// called by the producers with a record still in the LogMessage buffers
+void AsyncLogWorkerImpl::saveRecord(const LogRecordRef& record) {
+	if (isUrgent(record.call_site) && saveUrgent(record))
+	{
+		return;
+	}
+
+	if (shared_ring_)
+	{
+		saveToSharedRing(record);
+	}
+	else if (kPerThreadRings == record_transport_)
+	{
+		saveToThreadRing(record);
+	}
+	else
+	{
+		enqueue(makeLogEntry(record));
+	}
+}
+
+
+// A record that can never fit the ring is truncated rather than sent down another lane:
+// that lane would be drained first and the thread's own order would be lost
+void AsyncLogWorkerImpl::saveToThreadRing(const LogRecordRef& record) {
+	spsc_byte_ring& ring = threadRing()->ring_;
+	const size_t size = serializedRecordSize(record);
+
+	if (size > ring.max_block_size())
+	{
+		tstring text; // rare, the only allocation on this path
+		saveToThreadRing(truncatedRecord(record, ring.max_block_size(), text));
+		return;
+	}
+
+	unsigned char* at = ring.reserve(size);
+	while (nullptr == at)
+	{
+		const unsigned int level = recordLevel(record.call_site);
+
+		if (kDropNewest == queue_full_policy_ || (kDropBelowSeverity == queue_full_policy_ && level > drop_level_))
+		{
+			countDropped(level);
+			return;
+		}
+
+		bg_->wake();
+		std::this_thread::yield();
+		at = ring.reserve(size);
+	}
+
+	serializeRecord(record, at);
+	ring.commit();
+}
+
+
+// the record is serialized straight into the shared ring, no allocation on this path
+// unless it can never fit the ring: it is then truncated, see saveToThreadRing()
+void AsyncLogWorkerImpl::saveToSharedRing(const LogRecordRef& record) {
+	const size_t size = serializedRecordSize(record);
+
+	if (size > shared_ring_->max_block_size())
+	{
+		tstring text;
+		saveToSharedRing(truncatedRecord(record, shared_ring_->max_block_size(), text));
+		return;
+	}
+
+	unsigned char* at = shared_ring_->reserve(size);
+	while (nullptr == at)
+	{
+		const unsigned int level = recordLevel(record.call_site);
+
+		if (kDropNewest == queue_full_policy_ || (kDropBelowSeverity == queue_full_policy_ && level > drop_level_))
+		{
+			countDropped(level);
+			return;
+		}
+
+		bg_->wake();
+		std::this_thread::yield();
+		at = shared_ring_->reserve(size);
+	}
+
+	serializeRecord(record, at);
+	shared_ring_->commit(at);
+}
+
+
+// the calling thread's ring, registered on first use
+ThreadRecordRing* AsyncLogWorkerImpl::threadRing() {
+	if (t_ring_slot.worker_id_ != worker_id_ || !t_ring_slot.ring_)
+	{
+		t_ring_slot.close(); // registered with a previous worker
+
+		std::shared_ptr<ThreadRecordRing> ring = std::make_shared<ThreadRecordRing>(thread_ring_bytes_);
+		{
+			std::lock_guard<std::mutex> lock(thread_rings_mutex_);
+			thread_rings_.push_back(ring);
+			thread_rings_generation_.fetch_add(1, std::memory_order_acq_rel);
+		}
+
+		t_ring_slot.worker_id_ = worker_id_;
+		t_ring_slot.ring_ = ring;
+	}
+
+	return t_ring_slot.ring_.get();
+}
+
+
+// appends one record, "\nYYYY/MM/DD hh:mm:ss.uuuuuu uuu* pid  message", to buffer
+// all times are those of the LOG call, converted from the tick the caller took
+// cache: the calling formatter thread's, nullptr on the background thread
+void AsyncLogWorkerImpl::formatRecord(AsyncLogger::tick_type tick, const TCHAR* text, size_t text_size, const TCHAR* format, const unsigned char* args, size_t args_size, tstring& buffer, AsyncLogger::TimestampCache* cache) {
+	const long long log_time_ns = AsyncLogger::ticksToSystemNanoseconds(tick);
+	const long long log_time_s = (log_time_ns >= 0) ? log_time_ns / 1000000000 : 0;
+	const long long since_start_us = (log_time_ns - AsyncLogger::ticksToSystemNanoseconds(start_tick_)) / 1000;
+
+	buffer += _T("\n");
+	(cache ? *cache : timestamp_cache_).append(static_cast<std::time_t>(log_time_s), buffer); // date_formatted + " " + time_formatted
+	appendMicroseconds(static_cast<unsigned>((log_time_ns - log_time_s * 1000000000) / 1000), buffer);
+	buffer += _T(" ");
+	appendDecimal(since_start_us > 0 ? since_start_us : 0, buffer);
+	buffer += _T(" ");
+	appendDecimal(currentProcessPid, buffer);
+	buffer += _T("  ");
+	buffer.append(text, text_size);
+
+	if (format)
+	{
+		AsyncLogger::internal::appendFormatDeferred(format, args, args_size, buffer);
+	}
+}
+
+
+void AsyncLogWorkerImpl::formatRecord(const LogEntry& message, tstring& buffer, AsyncLogger::TimestampCache* cache) {
+	formatRecord(message.tick_, message.msg_.data(), message.msg_.size(), message.format_, message.args_.empty() ? nullptr : &message.args_[0], message.args_.size(), buffer, cache);
+}
+
+
+// a serialized record, read in place from a byte ring
+void AsyncLogWorkerImpl::formatRecord(const RecordHeader& record, tstring& buffer, AsyncLogger::TimestampCache* cache) {
+	formatRecord(record.tick, record.text(), record.text_size, record.format, record.args(), record.args_size, buffer, cache);
+}
+
+
+// used for single records, mostly the logger's own entries which are flushed at once
+void AsyncLogWorkerImpl::backgroundFileWrite(const LogEntry& message) {
+	tstring record;
+	formatRecord(message, record);
+	writeBuffer(record, recordLevel(message));
+}
+
+
+bool AsyncLogWorkerImpl::flushDue(unsigned int most_severe_level) const {
+	return most_severe_level <= flush_policy_.flush_level
+		|| pending_chars_.load(std::memory_order_relaxed) >= flush_policy_.max_pending_chars
+		|| std::chrono::steady_clock::now() - last_flush_ >= std::chrono::milliseconds(flush_policy_.flush_interval_ms);
+}
+
+
+// closing: the sink is closed next, text it still holds back is given up on
+void AsyncLogWorkerImpl::flushFile(bool closing) {
+	if (sink_ && is_logging_started)
+	{
+		const AsyncLogger::LogFileFlushResult result = sink_->flush();
+
+		if (AsyncLogger::kFlushDropped == result || (closing && AsyncLogger::kFlushHeldBack == result))
+		{
+			// counted as written, they are reported as dropped instead
+			unsigned long long lost = 0;
+			for (unsigned int level = 0; level <= LOG_ALL; ++level)
+			{
+				dropped_[level].fetch_add(unflushed_[level], std::memory_order_relaxed);
+				lost += unflushed_[level];
+			}
+			records_written_.fetch_sub(lost, std::memory_order_relaxed);
+		}
+
+		if (closing || AsyncLogger::kFlushHeldBack != result)
+		{
+			std::fill(unflushed_, unflushed_ + LOG_ALL + 1, 0ULL);
+		}
+	}
+
+	pending_chars_.store(0, std::memory_order_relaxed);
+	flushes_.fetch_add(1, std::memory_order_relaxed);
+	last_flush_ = std::chrono::steady_clock::now();
+}
+
+
+// single write of already formatted records, flushed as the FlushPolicy says, then the size check for rotation
+void AsyncLogWorkerImpl::writeBuffer(const tstring& buffer, unsigned int most_severe_level) {
+
+   TRY
+   {
+	   if (!(is_logging_started && sink_) || buffer.empty())
+	   {
+		   return;
+	   }
+
+	   const steady_time_point started = std::chrono::steady_clock::now();
+
+	   moveLevelCounts(collected_, unflushed_);
+	   sink_->write(buffer.data(), buffer.size());
+
+	   pending_chars_.fetch_add(buffer.size(), std::memory_order_relaxed);
+
+	   if (flushDue(most_severe_level))
+	   {
+		   flushFile();
+	   }
+
+	   write_time_.add(nanosecondsSince(started));
+
+	   const unsigned long long file_size = sink_->size();
+	   if (file_size > last_file_size_)
+	   {
+		   bytes_written_.fetch_add(file_size - last_file_size_, std::memory_order_relaxed);
+	   }
+	   last_file_size_ = file_size;
+
+	   file_size_kb = file_size / 1024;
+
+	   if (rotate_file_kb_ && file_size_kb > rotate_file_kb_ && change_log_file_retry < MAX_LOG_FILE_ROTATE_RETRIES)
+	   {
+		   file_size_kb = 0;
+
+		   if (change_log_path.TryCaptureMutexLock())
+		   {
+				change_log_file_retry ++;
+				change_log_path.ReleaseLock();
+				backgroundChangeLogFile(log_file_path_, log_file_name_, true);
+		   }
+	   }
+   }
+   CATCH_ALL(e)
+   {
+   
+   }
+   END_CATCH_ALL
+}
+
+
+// written_ahead: the fast lane already wrote the fatal message, before the backlog
+void AsyncLogWorkerImpl::backgroundExitFatal(const FatalMessage& fatal_message, bool written_ahead) 
+{
+	if (!written_ahead)
+	{
+		backgroundFileWrite(fatal_message.message_);
+	}
+	LogEntry flushEntry(_T("Log flushed successfully to disk \nExiting...\n\n"), AsyncLogger::tickNow());
+	backgroundFileWrite(flushEntry);
+
+	std::wcerr << _T("Asynclog exiting after receiving fatal event") << std::endl;
+	std::wcerr << _T("Log file at: [") << log_file_path_ << _T("]\n") << std::endl << std::flush;
+	flushFile();
+	if (sink_)
+	{
+		sink_->close();
+	}
+
+	AsyncLogger::shutDownLogging(); // only an initialized logger can recieve a fatal message. So shutting down logging now is fine.
+	exitWithDefaultSignalHandler(fatal_message.signal_id_);
+	perror("Asynclog exited after receiving FATAL trigger. Flush message status: "); // should never reach this point
+}
+
+
+tstring AsyncLogWorkerImpl::backgroundChangeLogFile(const tstring& directory, const tstring& file, bool _rotate) {
+
+	TRY
+	{
+		{
+
+			LockGuard<ICriticalSection> lock_holder(change_log_path);
+
+			// setting the new log as active
+			tstring old_log = log_file_path_ + _T("\\") + log_file_name_ + _T(".log");
+
+			if (sink_)
+			{
+				if (sink_->isOpen())
+				{
+					flushFile(true);
+					// is_logging_started stays set: the LOG calls of other threads go on building
+					// their messages, the records wait in the queue until the new file is open
+					sink_->close();
+				}
+			}
+
+			
+
+			std::unique_ptr<AsyncLogger::LogFileSink> log_stream = nullptr;
+
+			int result = openFile(directory, file, log_stream, _rotate);
+
+			if (nullptr == log_stream) 
+			{
+
+				openFile(log_file_path_, log_file_name_, log_stream, _rotate);
+
+				if (!log_stream) 
+				{
+					std::wcerr << _T("Cannot write logfile to location, attempting current directory") << std::endl;
+				}
+				else
+				{
+					sink_ = std::move(log_stream);
+					is_logging_started = true;
+				}
+			}
+			else
+			{
+				log_file_name_ = file;
+				log_file_path_ = directory;
+				sink_ = std::move(log_stream);
+				rotations_.fetch_add(1, std::memory_order_relaxed);
+
+				is_logging_started = true;
+
+				tstringstream ss_entry;
+
+				if (ERROR_SUCCESS == result)
+				{
+					ss_entry = getLoggerInittext();
+
+					ss_entry << _T("\n\tNew log file. The previous log file was at: ");
+					ss_entry << old_log;
+				}
+				else
+				{
+					ss_entry << _T("\n\tChanging logfile failed");
+				}
+
+				backgroundFileWrite(LogEntry(ss_entry.str(), AsyncLogger::tickNow()));
+			}
+		}
+	}
+	CATCH_ALL(e)
+	{
+
+	}
+	END_CATCH_ALL
+
+
+	return tstring(log_file_path_ + log_file_name_ + _T(".log"));
+}
+
+tstring  AsyncLogWorkerImpl::backgroundFileName() {
+   return log_file_path_;
+}
+
+
+void AsyncLogWorker::setlogLevel(unsigned int level)
+{
+	AsyncLogger::setLogLevel(level);
+}
+
+bool AsyncLogWorker::setModuleLogLevels(const tstring& module_levels)
+{
+	return AsyncLogger::setModuleLogLevels(module_levels);
+}
+
+void AsyncLogWorker::setFlushPolicy(const FlushPolicy& policy)
+{
+	if (pimpl_ && pimpl_->bg_)
+	{
+		AsyncLogWorkerImpl* worker = pimpl_.get();
+		pimpl_->bg_->send([worker, policy]() { worker->flush_policy_ = policy; });
+	}
+}
+
+AsyncLogWorkerStats AsyncLogWorker::stats() const
+{
+	AsyncLogWorkerStats snapshot = AsyncLogWorkerStats();
+
+	if (pimpl_)
+	{
+		snapshot.queue_depth = pimpl_->queue_depth_.load(std::memory_order_relaxed);
+		snapshot.queue_depth_high_water = pimpl_->queue_depth_high_water_.load(std::memory_order_relaxed);
+		snapshot.ring_bytes = pimpl_->ring_bytes_.load(std::memory_order_relaxed);
+		snapshot.ring_bytes_high_water = pimpl_->ring_bytes_high_water_.load(std::memory_order_relaxed);
+		snapshot.pending_chars = pimpl_->pending_chars_.load(std::memory_order_relaxed);
+		snapshot.records_written = pimpl_->records_written_.load(std::memory_order_relaxed);
+		snapshot.bytes_written = pimpl_->bytes_written_.load(std::memory_order_relaxed);
+		snapshot.flushes = pimpl_->flushes_.load(std::memory_order_relaxed);
+		snapshot.rotations = pimpl_->rotations_.load(std::memory_order_relaxed);
+		pimpl_->queue_latency_.snapshot(snapshot.queue_latency);
+		pimpl_->format_time_.snapshot(snapshot.format_time);
+		pimpl_->write_time_.snapshot(snapshot.write_time);
+
+		for (unsigned int level = 0; level <= LOG_ALL; ++level)
+		{
+			snapshot.dropped[level] = pimpl_->dropped_[level].load(std::memory_order_relaxed);
+		}
+	}
+
+	return snapshot;
+}
+
+unsigned long long AsyncLogHistogram::percentileNs(double fraction) const
+{
+	const double wanted = fraction * count;
+	unsigned long long seen = 0;
+
+	for (size_t bucket = 0; bucket < LOG_STATS_HISTOGRAM_BUCKETS && count; ++bucket)
+	{
+		seen += buckets[bucket];
+		if (seen >= wanted && buckets[bucket])
+		{
+			const unsigned long long upper = bucket ? (1ULL << bucket) - 1 : 0;
+			return (bucket + 1 < LOG_STATS_HISTOGRAM_BUCKETS && upper < max_ns) ? upper : max_ns;
+		}
+	}
+
+	return 0;
+}
+
+void AsyncLogWorker::setMaxBatchSize(size_t max_records)
+{
+	if (pimpl_ && max_records > 0)
+	{
+		pimpl_->max_batch_size_.store(max_records, std::memory_order_relaxed);
+	}
+}
+
+//
+// *****   BELOW AsyncLogWorker    *****
+// Public API implementation
+//
+AsyncLogWorker::AsyncLogWorker(const tstring& log_prefix, const tstring& log_directory, UINT level, const tstring& product_name , const tstring& version, const AsyncLogWorkerOptions& options)
+   :  pimpl_(new AsyncLogWorkerImpl(log_prefix, log_directory, options))
+{
+
+	AsyncLogger::setLogLevel(level);
+
+	_product_name = product_name;
+
+	_product_version = version;
+
+	assert((pimpl_ != nullptr) && "should never happen");
+}
+
+AsyncLogWorker::~AsyncLogWorker() {
+	if (pimpl_)
+		pimpl_.reset();
+
+   AsyncLogger::shutDownLoggingForActiveOnly(this);
+   std::wcerr << _T("\nExiting...") << _T("\n") << std::flush;
+}
+
+void AsyncLogWorker::save(AsyncLogger::internal::LogEntry&& msg) {
+	if ( pimpl_ && pimpl_->bg_)
+	{
+		pimpl_->enqueue(std::move(msg));
+		pimpl_->bg_->wake();
+	}
+}
+
+void AsyncLogWorker::save(const AsyncLogger::internal::LogRecordRef& record) {
+	if ( pimpl_ && pimpl_->bg_)
+	{
+		pimpl_->saveRecord(record);
+		pimpl_->bg_->wake();
+	}
+}
+
+void AsyncLogWorker::fatal(AsyncLogger::internal::FatalMessage&& fatal_message) {
+	if ( pimpl_ && pimpl_->bg_)
+	{
+		AsyncLogWorkerImpl* worker = pimpl_.get();
+
+		// the fatal text jumps the backlog on the fast lane, whatever fast_lane_level says: the
+		// process exits next. The exit still waits for the backlog
+		const bool written_ahead = pimpl_->saveUrgent(recordRef(fatal_message.message_));
+		pimpl_->bg_->wake();
+
+		MoveOnCopy<FatalMessage> message(std::move(fatal_message));
+		pimpl_->bg_->send([worker, message, written_ahead]() { worker->backgroundExitFatal(message._move_only, written_ahead); });
+	}
 }
 
 
@@ -595,7 +1888,7 @@ std::future<tstring> AsyncLogWorker::changeLogFile(const tstring& log_directory,
 	   tstringstream ss_change;
 		ss_change << _T("\n\tChanging log file to new location: ") << log_directory << file << _T(".log") << _T("\n");
 
-		pimpl_->backgroundFileWrite(LogEntry(ss_change.str().c_str(), AsyncLogger::internal::systemtime_now()));
+		save(LogEntry(ss_change.str().c_str(), AsyncLogger::tickNow()));
 
 		ss_change.str(_T(""));
 
@@ -15,6 +15,8 @@
 #include <thread>
 #include <ctime>
 #include <iomanip>
+#include <atomic>
+#include <mutex>
 
 
 namespace AsyncLogger { namespace internal {
@@ -74,3 +76,221 @@ tstring localtime_formatted(const std::time_t& time_snapshot, const tstring& tim
   return buffer.str();
 }
 } // AsyncLogger
+
+
+
+namespace {
+  // days since 1970-01-01 for a proleptic Gregorian date. Ref: http://howardhinnant.github.io/date_algorithms.html
+  long long daysFromCivil(long long year, unsigned month, unsigned day)
+  {
+    year -= (month <= 2);
+    const long long era = (year >= 0 ? year : year - 399) / 400;
+    const unsigned year_of_era = static_cast<unsigned>(year - era * 400);
+    const unsigned day_of_year = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    const unsigned day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+    return era * 146097 + static_cast<long long>(day_of_era) - 719468;
+  }
+
+  void civilFromDays(long long days, long long& year, unsigned& month, unsigned& day)
+  {
+    days += 719468;
+    const long long era = (days >= 0 ? days : days - 146096) / 146097;
+    const unsigned day_of_era = static_cast<unsigned>(days - era * 146097);
+    const unsigned year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146096) / 365;
+    const unsigned day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+    const unsigned month_index = (5 * day_of_year + 2) / 153;
+    day = day_of_year - (153 * month_index + 2) / 5 + 1;
+    month = month_index < 10 ? month_index + 3 : month_index - 9;
+    year = static_cast<long long>(year_of_era) + era * 400 + (month <= 2);
+  }
+
+  long long floorDiv(long long value, long long divisor)
+  {
+    return (value >= 0) ? value / divisor : -((-value + divisor - 1) / divisor);
+  }
+
+  void putDigits(TCHAR* at, unsigned value, int count)
+  {
+    for (int i = count - 1; i >= 0; --i)
+    {
+      at[i] = static_cast<TCHAR>(_T('0') + value % 10);
+      value /= 10;
+    }
+  }
+} // anonymous
+
+
+namespace AsyncLogger
+{
+TimestampCache::TimestampCache()
+  : cached_second_(0)
+  , offset_valid_from_(0)
+  , offset_valid_until_(0) // empty window: the first append() asks for the offset
+  , utc_offset_(0)
+{
+  std::char_traits<TCHAR>::copy(text_, _T("0000/00/00 00:00:00"), 20);
+}
+
+
+void TimestampCache::append(const std::time_t& time_snapshot, tstring& out)
+{
+  if (time_snapshot < offset_valid_from_ || time_snapshot >= offset_valid_until_)
+  {
+    refreshUtcOffset(time_snapshot);
+    cached_second_ = time_snapshot;
+    render(time_snapshot);
+  }
+  else if (time_snapshot != cached_second_)
+  {
+    const long long local_now = static_cast<long long>(time_snapshot) + utc_offset_;
+    const long long local_cached = static_cast<long long>(cached_second_) + utc_offset_;
+
+    if (floorDiv(local_now, 60) == floorDiv(local_cached, 60))
+    {
+      putDigits(text_ + 17, static_cast<unsigned>(local_now - floorDiv(local_now, 60) * 60), 2); // same minute, only the seconds move
+    }
+    else
+    {
+      render(time_snapshot);
+    }
+    cached_second_ = time_snapshot;
+  }
+
+  out.append(text_, 19);
+}
+
+
+void TimestampCache::render(const std::time_t& time_snapshot)
+{
+  const long long local = static_cast<long long>(time_snapshot) + utc_offset_;
+  const long long days = floorDiv(local, 86400);
+  const unsigned seconds_of_day = static_cast<unsigned>(local - days * 86400);
+
+  long long year = 0;
+  unsigned month = 0, day = 0;
+  civilFromDays(days, year, month, day);
+
+  putDigits(text_, static_cast<unsigned>(year), 4);
+  putDigits(text_ + 5, month, 2);
+  putDigits(text_ + 8, day, 2);
+  putDigits(text_ + 11, seconds_of_day / 3600, 2);
+  putDigits(text_ + 14, (seconds_of_day / 60) % 60, 2);
+  putDigits(text_ + 17, seconds_of_day % 60, 2);
+}
+
+
+// the only place that takes the timezone lock: once per TIMESTAMP_OFFSET_CHECK_SECONDS window
+void TimestampCache::refreshUtcOffset(const std::time_t& time_snapshot)
+{
+  const std::tm local = AsyncLogger::localtime(time_snapshot);
+  const long long local_seconds = daysFromCivil(local.tm_year + 1900LL, local.tm_mon + 1, local.tm_mday) * 86400
+                                  + local.tm_hour * 3600 + local.tm_min * 60 + local.tm_sec;
+
+  utc_offset_ = static_cast<long>(local_seconds - static_cast<long long>(time_snapshot));
+  offset_valid_from_ = static_cast<std::time_t>(floorDiv(time_snapshot, TIMESTAMP_OFFSET_CHECK_SECONDS) * TIMESTAMP_OFFSET_CHECK_SECONDS);
+  offset_valid_until_ = offset_valid_from_ + TIMESTAMP_OFFSET_CHECK_SECONDS;
+}
+} // AsyncLogger
+
+
+
+namespace {
+  // tick -> system_clock calibration. Written rarely (calibrateTicks), read for every record
+  // by the background worker: a sequence lock lets readers retry instead of locking
+  struct TickCalibration {
+    std::atomic<unsigned> sequence;
+    std::atomic<unsigned long long> base_tick;
+    std::atomic<long long> base_system_ns;
+    std::atomic<double> ns_per_tick;
+  };
+
+  long long systemNanosecondsNow()
+  {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+  }
+
+  // a tick and a system_clock reading taken as close together as possible
+  void sampleClocks(AsyncLogger::tick_type& tick, long long& system_ns)
+  {
+    const AsyncLogger::tick_type before = AsyncLogger::tickNow();
+    system_ns = systemNanosecondsNow();
+    const AsyncLogger::tick_type after = AsyncLogger::tickNow();
+    tick = before + (after - before) / 2;
+  }
+
+  double measureNanosecondsPerTick(const std::chrono::milliseconds& interval)
+  {
+#ifdef ASYNCLOG_TICKS_ARE_TSC
+    const std::chrono::steady_clock::time_point steady_start = std::chrono::steady_clock::now();
+    const AsyncLogger::tick_type tick_start = AsyncLogger::tickNow();
+    std::this_thread::sleep_for(interval);
+    const AsyncLogger::tick_type tick_end = AsyncLogger::tickNow();
+    const std::chrono::steady_clock::time_point steady_end = std::chrono::steady_clock::now();
+
+    const double elapsed_ns = static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(steady_end - steady_start).count());
+    return (tick_end > tick_start) ? elapsed_ns / static_cast<double>(tick_end - tick_start) : 1.0;
+#else
+    (void)interval; // steady_clock ticks have a known period
+    return 1e9 * static_cast<double>(std::chrono::steady_clock::period::num) / static_cast<double>(std::chrono::steady_clock::period::den);
+#endif
+  }
+
+  void publishCalibration(TickCalibration& calibration, const std::chrono::milliseconds& interval)
+  {
+    const double ns_per_tick = measureNanosecondsPerTick(interval);
+    AsyncLogger::tick_type tick = 0;
+    long long system_ns = 0;
+    sampleClocks(tick, system_ns);
+
+    calibration.sequence.fetch_add(1, std::memory_order_acq_rel); // odd: update in progress
+    calibration.base_tick.store(tick, std::memory_order_relaxed);
+    calibration.base_system_ns.store(system_ns, std::memory_order_relaxed);
+    calibration.ns_per_tick.store(ns_per_tick, std::memory_order_relaxed);
+    calibration.sequence.fetch_add(1, std::memory_order_release);
+  }
+
+  TickCalibration& tickCalibration()
+  {
+    static TickCalibration calibration;
+    static std::once_flag first_calibration;
+    std::call_once(first_calibration, [] {
+      calibration.sequence.store(0, std::memory_order_relaxed);
+      publishCalibration(calibration, std::chrono::milliseconds(1));
+    });
+    return calibration;
+  }
+} // anonymous
+
+
+namespace AsyncLogger
+{
+void calibrateTicks()
+{
+  static std::mutex calibration_mutex; // one writer at a time
+  std::lock_guard<std::mutex> lock(calibration_mutex);
+  publishCalibration(tickCalibration(), std::chrono::milliseconds(20));
+}
+
+
+long long ticksToSystemNanoseconds(tick_type tick)
+{
+  TickCalibration& calibration = tickCalibration();
+  unsigned sequence = 0;
+  unsigned long long base_tick = 0;
+  long long base_system_ns = 0;
+  double ns_per_tick = 1.0;
+
+  do
+  {
+    sequence = calibration.sequence.load(std::memory_order_acquire);
+    base_tick = calibration.base_tick.load(std::memory_order_relaxed);
+    base_system_ns = calibration.base_system_ns.load(std::memory_order_relaxed);
+    ns_per_tick = calibration.ns_per_tick.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+  } while ((sequence & 1) || sequence != calibration.sequence.load(std::memory_order_relaxed));
+
+  // signed: records created just before a recalibration are older than its base tick
+  const long long elapsed_ticks = static_cast<long long>(tick - base_tick);
+  return base_system_ns + static_cast<long long>(static_cast<double>(elapsed_ticks) * ns_per_tick);
+}
+} // AsyncLogger
@@ -14,10 +14,223 @@
 #include "stdafx.h"
 #include "active.h"
 #include <cassert>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__i386__) || defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#if !(defined(WIN32) || defined(_WIN32) || defined(__WIN32__))
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+#endif
+
+// <numaif.h> comes with libnuma, the two system calls are used without it
+#define ACTIVE_MPOL_PREFERRED 1
+#define ACTIVE_MPOL_MF_MOVE (1 << 1)
+#define ACTIVE_MAX_NUMA_NODES 1024
 
 using namespace AsyncLogger;
 
-Active::Active(): done_(false){}
+namespace {
+
+// tells the core we are in a spin-wait loop, saves power and the pipeline flush on exit
+inline void cpuRelax() {
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+  _mm_pause();
+#endif
+}
+
+void reportThreadOptionFailure(const char* option, int error) {
+  std::cerr << "Active thread: could not apply " << option;
+  if (error) {
+    std::cerr << ": " << std::strerror(error);
+  }
+  std::cerr << std::endl;
+}
+
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__)
+
+typedef HRESULT (WINAPI *SetThreadDescriptionFunction)(HANDLE, PCWSTR);
+
+void setThreadCpus(const std::vector<int>& cpus) {
+  DWORD_PTR mask = 0;
+  for (size_t i = 0; i < cpus.size(); ++i) {
+    if (cpus[i] >= 0 && cpus[i] < static_cast<int>(sizeof(DWORD_PTR) * 8)) {
+      mask |= static_cast<DWORD_PTR>(1) << cpus[i];
+    }
+  }
+  if (0 == mask || 0 == ::SetThreadAffinityMask(::GetCurrentThread(), mask)) {
+    reportThreadOptionFailure("the CPU set", 0);
+  }
+}
+
+void setThreadNice(int nice) {
+  int priority = THREAD_PRIORITY_NORMAL;
+  if (nice <= -10) {
+    priority = THREAD_PRIORITY_HIGHEST;
+  } else if (nice < 0) {
+    priority = THREAD_PRIORITY_ABOVE_NORMAL;
+  } else if (nice >= 10) {
+    priority = THREAD_PRIORITY_LOWEST;
+  } else if (nice > 0) {
+    priority = THREAD_PRIORITY_BELOW_NORMAL;
+  }
+  if (!::SetThreadPriority(::GetCurrentThread(), priority)) {
+    reportThreadOptionFailure("the thread priority", 0);
+  }
+}
+
+void setThreadSchedPolicy(int, int) {
+  reportThreadOptionFailure("the scheduling policy, not available on Windows (use nice)", 0);
+}
+
+void setThreadName(const std::string& name) {
+  // Windows 10 1607 and later only, looked up so that older systems still load the binary
+  const SetThreadDescriptionFunction set_description = reinterpret_cast<SetThreadDescriptionFunction>(
+    ::GetProcAddress(::GetModuleHandleW(L"kernel32.dll"), "SetThreadDescription"));
+  if (set_description) {
+    const std::wstring wide_name(name.begin(), name.end());
+    set_description(::GetCurrentThread(), wide_name.c_str());
+  }
+}
+
+// no per-thread memory policy on Windows: run on the node's CPUs, first touch does the rest
+void setThreadNumaNode(int numa_node, bool cpus_set) {
+  ULONGLONG node_cpus = 0;
+  if (cpus_set) {
+    return; // the explicit CPU set wins
+  }
+  if (!::GetNumaNodeProcessorMask(static_cast<UCHAR>(numa_node), &node_cpus) || 0 == node_cpus
+      || 0 == ::SetThreadAffinityMask(::GetCurrentThread(), static_cast<DWORD_PTR>(node_cpus))) {
+    reportThreadOptionFailure("the NUMA node", 0);
+  }
+}
+
+#else
+
+void setThreadCpus(const std::vector<int>& cpus) {
+#if defined(__linux__)
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  for (size_t i = 0; i < cpus.size(); ++i) {
+    if (cpus[i] >= 0 && cpus[i] < CPU_SETSIZE) {
+      CPU_SET(cpus[i], &cpu_set);
+    }
+  }
+  const int error = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set);
+  if (error) {
+    reportThreadOptionFailure("the CPU set", error);
+  }
+#else
+  (void)cpus;
+  reportThreadOptionFailure("the CPU set, not available on this platform", 0);
+#endif
+}
+
+void setThreadNice(int nice) {
+#if defined(__linux__)
+  // on Linux the nice value belongs to the thread (its task id), not to the whole process
+  if (0 != setpriority(PRIO_PROCESS, static_cast<id_t>(syscall(SYS_gettid)), nice)) {
+    reportThreadOptionFailure("the nice value", errno);
+  }
+#else
+  (void)nice;
+  reportThreadOptionFailure("a thread nice value, not available on this platform", 0);
+#endif
+}
+
+void setThreadSchedPolicy(int policy, int priority) {
+  sched_param parameters;
+  std::memset(&parameters, 0, sizeof(parameters));
+  parameters.sched_priority = priority;
+  const int error = pthread_setschedparam(pthread_self(), policy, &parameters);
+  if (error) {
+    reportThreadOptionFailure("the scheduling policy", error);
+  }
+}
+
+void setThreadName(const std::string& name) {
+#if defined(__APPLE__)
+  pthread_setname_np(name.c_str());
+#elif defined(__linux__)
+  const std::string short_name = name.substr(0, 15); // the kernel keeps 16 bytes with the terminator
+  const int error = pthread_setname_np(pthread_self(), short_name.c_str());
+  if (error) {
+    reportThreadOptionFailure("the thread name", error);
+  }
+#else
+  (void)name;
+#endif
+}
+
+void setThreadNumaNode(int numa_node, bool) {
+#if defined(__linux__)
+  unsigned long nodes[ACTIVE_MAX_NUMA_NODES / (sizeof(unsigned long) * 8)] = {0};
+  if (numa_node >= ACTIVE_MAX_NUMA_NODES) {
+    reportThreadOptionFailure("the NUMA node", EINVAL);
+    return;
+  }
+  nodes[numa_node / (sizeof(unsigned long) * 8)] = 1UL << (numa_node % (sizeof(unsigned long) * 8));
+  if (0 != syscall(SYS_set_mempolicy, ACTIVE_MPOL_PREFERRED, nodes, ACTIVE_MAX_NUMA_NODES + 1)) {
+    reportThreadOptionFailure("the NUMA node", errno);
+  }
+#else
+  (void)numa_node;
+  reportThreadOptionFailure("the NUMA node, not available on this platform", 0);
+#endif
+}
+
+#endif
+
+} // anonymous
+
+
+bool AsyncLogger::bindMemoryToNumaNode(const void* memory, size_t size, int numa_node) {
+#if defined(__linux__) && !(defined(WIN32) || defined(_WIN32) || defined(__WIN32__))
+  if (nullptr == memory || 0 == size || numa_node < 0 || numa_node >= ACTIVE_MAX_NUMA_NODES) {
+    return false;
+  }
+
+  const uintptr_t page_size = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+  const uintptr_t begin = reinterpret_cast<uintptr_t>(memory) & ~(page_size - 1);
+  const uintptr_t end = reinterpret_cast<uintptr_t>(memory) + size;
+
+  unsigned long nodes[ACTIVE_MAX_NUMA_NODES / (sizeof(unsigned long) * 8)] = {0};
+  nodes[numa_node / (sizeof(unsigned long) * 8)] = 1UL << (numa_node % (sizeof(unsigned long) * 8));
+
+  // the whole pages around the buffer are moved, neighbouring allocations go with them
+  return 0 == syscall(SYS_mbind, begin, end - begin, ACTIVE_MPOL_PREFERRED, nodes, ACTIVE_MAX_NUMA_NODES + 1, ACTIVE_MPOL_MF_MOVE);
+#else
+  (void)memory;
+  (void)size;
+  (void)numa_node;
+  return false;
+#endif
+}
+
+Active::Active(ActiveQueueType queue_type, size_t ring_capacity, ActiveDrain* drain, const ActiveWaitPolicy& wait_policy, const ActiveThreadOptions& thread_options)
+  : queue_type_(queue_type)
+  , drain_(drain)
+  , sleeping_(false)
+  , wait_policy_(wait_policy)
+  , thread_options_(thread_options)
+  , done_(false)
+{
+  if (kLockFreeRingQueue == queue_type_) {
+    ring_.reset(new mpsc_ring_buffer<Callback>(ring_capacity));
+  }
+}
 
 Active::~Active() {
   Callback quit_token = std::bind(&Active::doDone, this);
@@ -26,10 +239,22 @@ Active::~Active() {
 }
 
 // Add asynchronously a work-message to queue
-void Active::send(Callback msg_){
+void Active::send(const Callback& msg_){
+	send(Callback(msg_));
+}
+
+void Active::send(Callback&& msg_){
 	try
 	{
-		mq_.push(msg_);
+		if (ring_)
+		{
+			ring_->push(std::move(msg_)); // yields while the ring is full
+			wake();
+		}
+		else
+		{
+			mq_.push(std::move(msg_));
+		}
 	}
 	catch (...)
 	{
@@ -38,17 +263,173 @@ void Active::send(Callback msg_){
 }
 
 
-// Will wait for msgs if queue is empty
+// Pairs with waitForWork(): either this sees sleeping_ set, or the thread sees the
+// item pushed before this call when it checks for work after setting sleeping_.
+// Taking wake_mutex_ makes sure the notify cannot fall between that check and the wait
+void Active::wake() {
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (sleeping_.load(std::memory_order_relaxed)) {
+    std::lock_guard<std::mutex> lock(wake_mutex_);
+    wake_cond_.notify_one();
+  }
+}
+
+
+// runs on the Active thread, before it serves any work
+void Active::applyThreadOptions() {
+  const ActiveThreadOptions& options = thread_options_;
+
+  if (!options.name.empty()) {
+    setThreadName(options.name);
+  }
+  if (!options.cpus.empty()) {
+    setThreadCpus(options.cpus);
+  }
+  if (options.numa_node >= 0) {
+    setThreadNumaNode(options.numa_node, !options.cpus.empty());
+  }
+  if (ACTIVE_THREAD_KEEP != options.sched_policy) {
+    setThreadSchedPolicy(options.sched_policy, options.sched_priority);
+  }
+  if (ACTIVE_THREAD_KEEP != options.nice) {
+    setThreadNice(options.nice); // after the policy, switching to SCHED_OTHER/BATCH may reset it
+  }
+}
+
+
+void Active::run() {
+  applyThreadOptions();
+
+  if (ring_) {
+    runRingQueue();
+  } else {
+    runSharedQueue();
+  }
+}
+
+
+bool Active::hasWork() const {
+  return !ring_->empty() || (drain_ && drain_->pending());
+}
+
+
+// Called when idle, returns when there may be work, as the ActiveWaitPolicy says.
+// kSpinThenPark keeps looking for work for idle_spin_us, busy at first, then yielding,
+// so that a steady stream of items never puts the thread to sleep. Then, like
+// kBlockingWait, it announces that it sleeps (see wake()) and parks. The bounded wait
+// lets the ActiveDrain run its timed work, e.g. the flush interval, while nothing is logged
+void Active::waitForWork() {
+  switch (wait_policy_.strategy) {
+  case kBusySpin:
+    for (unsigned int spins = 0; spins < ACTIVE_IDLE_SPIN_COUNT && !hasWork(); ++spins) {
+      cpuRelax();
+    }
+    return; // back to the run loop, which also serves the timed work
+
+  case kYieldLoop:
+    std::this_thread::yield();
+    return;
+
+  case kSpinThenPark:
+    {
+      const std::chrono::steady_clock::time_point spin_until =
+        std::chrono::steady_clock::now() + std::chrono::microseconds(wait_policy_.idle_spin_us);
+
+      for (unsigned int spins = 0; std::chrono::steady_clock::now() < spin_until; ++spins) {
+        if (hasWork()) {
+          return;
+        }
+        if (spins >= ACTIVE_IDLE_SPIN_COUNT) {
+          std::this_thread::yield();
+        } else {
+          cpuRelax();
+        }
+      }
+    }
+    break;
+
+  default: // kBlockingWait
+    break;
+  }
+
+  std::unique_lock<std::mutex> lock(wake_mutex_);
+  sleeping_.store(true, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  wake_cond_.wait_for(lock, std::chrono::milliseconds(ACTIVE_RING_WAIT_MS), [this] { return hasWork(); });
+  sleeping_.store(false, std::memory_order_relaxed);
+}
+
+
+// Drains everything published on the ring, up to ACTIVE_MAX_BATCH_SIZE at a time.
+// Callbacks are popped before the ActiveDrain is served so that items a caller queued
+// before its Callback are handled first (e.g. log records before a fatal or a file change).
+void Active::runRingQueue() {
+  std::vector<Callback> batch;
+  batch.reserve(ACTIVE_MAX_BATCH_SIZE);
+
+  while (!done_) {
+    ring_->pop_batch(batch, ACTIVE_MAX_BATCH_SIZE);
+
+    size_t drained = 0;
+    if (drain_)
+    {
+      try
+      {
+        drained = drain_->drain(!batch.empty());
+      }
+      catch (...)
+      {
+
+      }
+    }
+
+    if (batch.empty())
+    {
+      if (0 == drained)
+      {
+        waitForWork();
+      }
+      continue;
+    }
+
+    for (size_t i = 0; i < batch.size() && !done_; ++i) // nothing runs after the quit token of ~Active
+    {
+      try
+      {
+        batch[i]();
+      }
+      catch (...)
+      {
+
+      }
+    }
+
+    batch.clear();
+  }
+}
+
+
+// Will wait for msgs if queue is empty, after looking for idle_spin_us without blocking
 // A great explanation of how this is done (using Qt's library):
 // http://doc.qt.nokia.com/stable/qwaitcondition.html
-void Active::run() {
+void Active::runSharedQueue() {
   while (!done_) {
     // wait till job is available, then retrieve it and
     // executes the retrieved job in this thread (background)
 	  try
 	  {
 		Callback func;
-		if(mq_.wait_infitine_and_pop(func))
+		bool popped = mq_.try_and_pop(func);
+
+		const std::chrono::steady_clock::time_point spin_until =
+			std::chrono::steady_clock::now() + std::chrono::microseconds(wait_policy_.idle_spin_us);
+		while (!popped && std::chrono::steady_clock::now() < spin_until)
+		{
+			std::this_thread::yield();
+			popped = mq_.try_and_pop(func);
+		}
+
+		if(popped || mq_.wait_infitine_and_pop(func))
 		{
 			func();
 		}
@@ -61,8 +442,8 @@ void Active::run() {
 }
 
 // Factory: safe construction of object before thread start
-std::unique_ptr<Active> Active::createActive(){
-  std::unique_ptr<Active> aPtr(new Active());
+std::unique_ptr<Active> Active::createActive(ActiveQueueType queue_type, size_t ring_capacity, ActiveDrain* drain, const ActiveWaitPolicy& wait_policy, const ActiveThreadOptions& thread_options){
+  std::unique_ptr<Active> aPtr(new Active(queue_type, ring_capacity, drain, wait_policy, thread_options));
   aPtr->thd_ = std::thread(&Active::run, aPtr.get());
   return aPtr;
 }
@@ -66,9 +66,9 @@ void crashHandler(int signal_number)
     fatal_stream << _T("\n\n***** FATAL TRIGGER RECEIVED ******* ") << std::endl;
     fatal_stream << _T("\n***** SIGNAL ") << signalName(signal_number) << _T("(") << signal_number << _T(")") << std::endl;
 
-    FatalMessage fatal_message( LogEntry(fatal_stream.str(), AsyncLogger::internal::systemtime_now()),FatalMessage::kReasonOS_FATAL_SIGNAL, signal_number);
-    FatalTrigger trigger(fatal_message);
-    std::wcerr << fatal_message.message_.msg_ << std::endl << std::flush;
+    FatalMessage fatal_message( LogEntry(fatal_stream.str(), AsyncLogger::tickNow()),FatalMessage::kReasonOS_FATAL_SIGNAL, signal_number);
+    FatalTrigger trigger(std::move(fatal_message));
+    std::wcerr << trigger.message_.message_.msg_ << std::endl << std::flush;
 } // scope exit - message sent to LogWorker, wait to die...
 
 
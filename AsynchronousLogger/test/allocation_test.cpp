@@ -0,0 +1,114 @@
+/** ==========================================================================
+* Filename:allocation_test.cpp  Heap allocations of a steady state LOG call
+*
+* Pass / fail check of the allocation budget of one message, from the LOG
+* statement to the log file, for each record transport and logging API. The
+* counting operator new / delete of allocation_counter.h count every thread.
+*
+* A worker is warmed up first with BENCHMARK_MESSAGES messages: call sites,
+* thread locals, message buffers and the background thread's batch and write
+* buffers. Then BENCHMARK_BASELINE_MESSAGES and
+* BENCHMARK_MESSAGES messages are logged, each run followed by a wait until
+* everything is written. The difference between the two runs divided by the
+* difference in messages is the steady state cost of one message.
+*
+* Size rotation is turned off: starting a new file allocates far more than the
+* budgets allow. A case fails if the worker opened a new file anyway.
+*
+* Returns 0 when every case is within its budget.
+* ********************************************* */
+
+#include "stdafx.h"
+
+#include "benchmark.h"
+#include "allocation_counter.h"
+
+#include <cstdio>
+#include <string>
+
+#define BENCHMARK_MESSAGES 20000
+#define BENCHMARK_BASELINE_MESSAGES 2000
+
+using namespace benchmark;
+
+namespace
+{
+struct Case
+{
+	const char* transport_name;
+	RecordTransport transport;
+	unsigned int fast_lane_level; // 0: no fast lane
+	LogApi api;
+	double max_allocations; // per message
+};
+
+const TCHAR* const kLogName = _T("allocation_test");
+
+// allocations while messages are logged and written
+unsigned long long allocationsOf(BenchmarkWorker& worker, LogApi api, int messages)
+{
+	const unsigned long long before = g_allocations.load();
+	for (int i = 0; i < messages; ++i)
+	{
+		logOnce(api, i);
+	}
+	worker.waitUntilWritten();
+	return g_allocations.load() - before;
+}
+
+// \return false if the worker started a new log file while the allocations were counted
+bool allocationsPerMessage(const Case& test_case, double& allocations)
+{
+	AsyncLogWorkerOptions options;
+	options.record_transport = test_case.transport;
+	options.fast_lane_level = test_case.fast_lane_level;
+	options.rotate_file_kb = 0;
+	_tremove((tstring(_T("./")) + kLogName + _T(".log")).c_str()); // each case starts a file of its own
+	BenchmarkWorker worker(kLogName, INFO, options);
+
+	allocationsOf(worker, test_case.api, BENCHMARK_MESSAGES); // warm up, the batches grow to their largest
+	const unsigned long long rotations = worker.worker().stats().rotations;
+	const unsigned long long baseline = allocationsOf(worker, test_case.api, BENCHMARK_BASELINE_MESSAGES);
+	const unsigned long long full = allocationsOf(worker, test_case.api, BENCHMARK_MESSAGES);
+	allocations = (static_cast<double>(full) - static_cast<double>(baseline)) / (BENCHMARK_MESSAGES - BENCHMARK_BASELINE_MESSAGES);
+	return worker.worker().stats().rotations == rotations;
+}
+} // anonymous
+
+
+int main()
+{
+	const Case cases[] = {
+		// the message body is allocated once for its LogEntry and moved from there on, never copied
+		{"record queue", kRecordQueue, 0, kLogStream, 1.0},
+		{"record queue", kRecordQueue, 0, kLogPrintf, 1.0},
+		{"record queue", kRecordQueue, 0, kLogDisabled, 0.0},
+		// records are written in place into the byte rings: no allocation at all
+		{"shared ring", kSharedByteRing, 0, kLogStream, 0.0},
+		{"shared ring", kSharedByteRing, 0, kLogPrintf, 0.0},
+		{"shared ring", kSharedByteRing, 0, kLogDeferred, 0.0},
+		{"shared ring", kSharedByteRing, 0, kLogDisabled, 0.0},
+		{"thread rings", kPerThreadRings, 0, kLogStream, 0.0},
+		{"thread rings", kPerThreadRings, 0, kLogPrintf, 0.0},
+		{"thread rings", kPerThreadRings, 0, kLogDeferred, 0.0},
+		// every record takes the fast lane, serialized like on the shared ring
+		{"fast lane", kSharedByteRing, INFO, kLogStream, 0.0},
+		{"fast lane", kSharedByteRing, INFO, kLogPrintf, 0.0},
+	};
+
+	std::printf("%-16s %-20s %12s %8s\n", "transport", "api", "allocations", "budget");
+
+	bool passed = true;
+	for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i)
+	{
+		double allocations = 0.0;
+		const bool same_file = allocationsPerMessage(cases[i], allocations);
+		const bool within_budget = allocations <= cases[i].max_allocations + 0.001; // a rare flush or timer
+		passed = passed && same_file && within_budget;
+		std::printf("%-16s %-20s %12.3f %8.0f %s\n", cases[i].transport_name, apiName(cases[i].api), allocations,
+		            cases[i].max_allocations, !same_file ? "FAILED (log file rotated)" : within_budget ? "ok" : "FAILED");
+	}
+
+	std::printf("\n%s\n", passed ? "PASSED" : "FAILED");
+	return passed ? 0 : 1;
+}
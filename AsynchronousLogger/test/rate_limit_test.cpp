@@ -0,0 +1,212 @@
+/** ==========================================================================
+* Filename:rate_limit_test.cpp  Behavior of LOG_EVERY_N, LOG_FIRST_N and LOG_EVERY_T
+*
+* Pass / fail checks of the rate limited statements:
+*   - the states alone: N = 0 and N = 1 log every time, LOG_FIRST_N(level, 0)
+*     never logs, the suppressed counts between two logged occurrences
+*   - LOG_EVERY_T from several threads at once: no occurrence is lost, every
+*     one is either logged or counted as suppressed
+*   - in the log file: the "[N suppressed] " prefix, and that occurrences while
+*     the level is off are neither logged nor counted as suppressed
+*
+* Returns 0 when every check passes.
+* ********************************************* */
+
+#include "stdafx.h"
+
+#include "benchmark.h"
+
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#define TEST_THREADS 4
+#define TEST_CALLS_PER_THREAD 200000
+#define TEST_INTERVAL_MS 20
+
+using namespace benchmark;
+
+namespace
+{
+bool g_passed = true;
+
+void check(bool condition, const char* what)
+{
+	std::printf("%-64s %s\n", what, condition ? "ok" : "FAILED");
+	g_passed = g_passed && condition;
+}
+
+void checkEveryN()
+{
+	unsigned long long suppressed = 42;
+	bool all_logged = true;
+
+	AsyncLogger::internal::LogEveryNState every_one;
+	for (int i = 0; i < 5; ++i)
+	{
+		all_logged = all_logged && every_one.shouldLog(1, suppressed) && 0 == suppressed;
+	}
+	check(all_logged, "LOG_EVERY_N(level, 1) logs every time, nothing suppressed");
+
+	AsyncLogger::internal::LogEveryNState every_zero;
+	all_logged = true;
+	for (int i = 0; i < 5; ++i)
+	{
+		all_logged = all_logged && every_zero.shouldLog(0, suppressed) && 0 == suppressed;
+	}
+	check(all_logged, "LOG_EVERY_N(level, 0) logs every time, nothing suppressed");
+
+	AsyncLogger::internal::LogEveryNState every_three;
+	tstringstream pattern;
+	for (int i = 0; i < 7; ++i)
+	{
+		suppressed = 42;
+		if (every_three.shouldLog(3, suppressed))
+		{
+			pattern << i << _T(":") << suppressed << _T(" ");
+		}
+	}
+	check(_T("0:0 3:2 6:2 ") == pattern.str(), "LOG_EVERY_N(level, 3) logs 0, 3, 6 with 2 suppressed after the first");
+}
+
+void checkFirstN()
+{
+	AsyncLogger::internal::LogFirstNState first_zero;
+	bool none_logged = true;
+	for (int i = 0; i < 5; ++i)
+	{
+		none_logged = none_logged && !first_zero.shouldLog(0);
+	}
+	check(none_logged, "LOG_FIRST_N(level, 0) never logs");
+
+	AsyncLogger::internal::LogFirstNState first_two;
+	int logged = 0;
+	for (int i = 0; i < 5; ++i)
+	{
+		logged += first_two.shouldLog(2) ? 1 : 0;
+	}
+	check(2 == logged, "LOG_FIRST_N(level, 2) logs twice");
+}
+
+void checkEveryTContention()
+{
+	AsyncLogger::internal::LogEveryTState state;
+	std::atomic<unsigned long long> logged(0);
+	std::atomic<unsigned long long> reported(0);
+	std::vector<std::thread> threads;
+
+	const bench_clock::time_point start = bench_clock::now();
+	for (int t = 0; t < TEST_THREADS; ++t)
+	{
+		threads.push_back(std::thread([&]() {
+			for (int i = 0; i < TEST_CALLS_PER_THREAD; ++i)
+			{
+				unsigned long long suppressed = 0;
+				if (state.shouldLog(TEST_INTERVAL_MS, suppressed))
+				{
+					logged.fetch_add(1);
+					reported.fetch_add(suppressed);
+				}
+			}
+		}));
+	}
+	for (size_t t = 0; t < threads.size(); ++t)
+	{
+		threads[t].join();
+	}
+	const long long elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(bench_clock::now() - start).count();
+
+	const unsigned long long calls = static_cast<unsigned long long>(TEST_THREADS) * TEST_CALLS_PER_THREAD;
+	check(logged.load() + reported.load() + state.suppressed_.load() == calls,
+	      "LOG_EVERY_T under contention: each call logged or counted");
+	check(logged.load() >= 1 && logged.load() <= static_cast<unsigned long long>(elapsed_ms / TEST_INTERVAL_MS + 1),
+	      "LOG_EVERY_T under contention: at most one per interval");
+}
+
+// the file BenchmarkWorker(name) writes to, appended to if it exists
+tstring logFilePath(const tstring& name)
+{
+	return _T("./") + name + _T(".log");
+}
+
+tstring readLogFile(BenchmarkWorker& worker, const tstring& name)
+{
+	worker.waitUntilWritten();
+	const tstring path = logFilePath(name);
+#if defined(_MSC_VER)
+	std::ifstream file(path.c_str());
+#else
+	std::ifstream file(std::string(path.begin(), path.end()).c_str());
+#endif
+	std::stringstream content;
+	content << file.rdbuf();
+
+	const std::string text = content.str(); // the messages checked are ASCII
+	return tstring(text.begin(), text.end());
+}
+
+size_t occurrences(const tstring& text, const tstring& what)
+{
+	size_t count = 0;
+	for (size_t at = text.find(what); tstring::npos != at; at = text.find(what, at + what.size()))
+	{
+		++count;
+	}
+	return count;
+}
+
+// the same two statements every time
+void logRateLimited(int i)
+{
+	LOG_EVERY_N(INFO, 3) << _T("every-n ") << i;
+	LOG_EVERY_T(INFO, 200) << _T("every-t ") << i;
+}
+
+void checkLogFile()
+{
+	const tstring name = _T("rate_limit_test");
+	_tremove(logFilePath(name).c_str()); // only this run's records
+	BenchmarkWorker worker(name);
+
+	for (int i = 0; i < 4; ++i)
+	{
+		logRateLimited(i);
+	}
+
+	worker.worker().setlogLevel(WARNING); // off: neither logged nor counted
+	for (int i = 4; i < 9; ++i)
+	{
+		logRateLimited(i);
+	}
+	worker.worker().setlogLevel(INFO);
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(250));
+	for (int i = 9; i < 12; ++i)
+	{
+		logRateLimited(i);
+	}
+
+	const tstring text = readLogFile(worker, name);
+	check(3 == occurrences(text, _T("every-n ")), "LOG_EVERY_N(INFO, 3) wrote 3 of the 7 enabled occurrences");
+	check(1 == occurrences(text, _T("]\tevery-n 0")), "LOG_EVERY_N: no prefix on the first occurrence");
+	check(1 == occurrences(text, _T("[2 suppressed] every-n 3")), "LOG_EVERY_N: [2 suppressed] prefix");
+	check(1 == occurrences(text, _T("[2 suppressed] every-n 11")), "LOG_EVERY_N: level off occurrences not counted");
+	check(2 == occurrences(text, _T("every-t ")), "LOG_EVERY_T(INFO, 200) wrote 2 occurrences");
+	check(1 == occurrences(text, _T("[3 suppressed] every-t 9")), "LOG_EVERY_T: [3 suppressed] prefix, level off not counted");
+}
+} // anonymous
+
+
+int main()
+{
+	checkEveryN();
+	checkFirstN();
+	checkEveryTContention();
+	checkLogFile();
+
+	std::printf("\n%s\n", g_passed ? "PASSED" : "FAILED");
+	return g_passed ? 0 : 1;
+}